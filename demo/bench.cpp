@@ -0,0 +1,154 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include "mini_ws/mini_ws.h"
+
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#include <WinSock2.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+// Round trip latency of small binary messages between two threads of this process.
+// Compares the transports (loopback TCP, IPv6, unix sockets) and the socket profiles.
+// busy-poll spins on the reads instead of sleeping in poll. With 2+ cores the client and
+// the echo server threads are pinned to cpus 0 and 1, so both spin at the same time.
+//
+// Usage: bench [round_trips] [payload_bytes]
+
+using Clock = std::chrono::steady_clock;
+
+struct Transport {
+	const char* name;
+	const char* address;
+};
+
+static const Transport transports[] = {
+	{ "tcp4",          "127.0.0.1" },
+	{ "tcp6",          "::1" },
+	{ "unix",          "unix:/tmp/mini_ws_bench.sock" },
+#ifdef __linux__
+	{ "unix-abstract", "unix:@mini_ws_bench" },
+#endif
+};
+
+struct Profile {
+	const char* name;
+	WsServerProfile profile;
+};
+
+static const Profile profiles[] = {
+	{ "default",         WS_PROFILE_DEFAULT },
+	{ "low-latency",     WS_PROFILE_LOW_LATENCY },
+	{ "high-throughput", WS_PROFILE_HIGH_THROUGHPUT },
+	{ "busy-poll",       WS_PROFILE_BUSY_POLL },
+};
+
+static bool pin_threads;
+
+static void echoServer(WsServer* server) {
+	if (pin_threads)
+		ws_pin_thread(1);
+	WsConn* conn = ws_server_accept(server, 5000000);
+	if (!conn)
+		return;
+	WsEvent evt;
+	while (conn) {
+		if (!ws_conn_poll_event(&conn, &evt, 1000000))
+			continue;
+		if (evt.type == WS_EVT_BINARY)
+			ws_conn_send_binary(conn, evt.payload, evt.payload_len);
+	}
+}
+
+static double percentile(const std::vector<double>& sorted, double p) {
+	size_t idx = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+	return sorted[idx];
+}
+
+static bool run(const Transport& t, const Profile& p, int round_trips, size_t payload_bytes) {
+	const int port = 7451;
+
+	// Two threads spinning on a single core just take turns
+	if (p.profile == WS_PROFILE_BUSY_POLL && !pin_threads) {
+		printf("%-14s %-16s needs 2 cores\n", t.name, p.name);
+		return false;
+	}
+
+	WsServerConfig cfg;
+	ws_server_config_init(&cfg, p.profile);
+	cfg.bind_address = t.address;
+	WsServer* server = ws_server_create_ex(port, &cfg);
+	if (!server) {
+		printf("%-14s %-16s not available\n", t.name, p.name);
+		return false;
+	}
+
+	std::thread server_thread(echoServer, server);
+
+	WsConn* conn = ws_client_connect(t.address, port, &cfg, 1000000);
+	if (!conn) {
+		printf("%-14s %-16s connect failed\n", t.name, p.name);
+		server_thread.join();
+		ws_server_destroy(server);
+		return false;
+	}
+
+	std::vector<uint8_t> payload(payload_bytes, 0x5a);
+	std::vector<double> samples;
+	samples.reserve(round_trips);
+
+	WsEvent evt;
+	for (int i = 0; i < round_trips && conn; ++i) {
+		auto t0 = Clock::now();
+		ws_conn_send_binary(conn, payload.data(), payload.size());
+		while (conn) {
+			if (ws_conn_poll_event(&conn, &evt, 1000000) && evt.type == WS_EVT_BINARY)
+				break;
+		}
+		samples.push_back(std::chrono::duration<double, std::micro>(Clock::now() - t0).count());
+	}
+
+	if (conn)
+		ws_conn_destroy(conn);
+	server_thread.join();
+	ws_server_destroy(server);
+
+	if (samples.empty())
+		return false;
+	std::sort(samples.begin(), samples.end());
+	double avg = 0.0;
+	for (double s : samples)
+		avg += s;
+	avg /= samples.size();
+	printf("%-14s %-16s avg=%9.1f p50=%9.1f p99=%9.1f max=%9.1f us\n", t.name, p.name,
+		avg, percentile(samples, 0.5), percentile(samples, 0.99), samples.back());
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+#ifdef _WIN32
+	WSADATA wsa_data;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0)
+		return -1;
+#endif
+
+	int round_trips = argc > 1 ? atoi(argv[1]) : 2000;
+	size_t payload_bytes = argc > 2 ? (size_t)atoi(argv[2]) : 64;
+	pin_threads = std::thread::hardware_concurrency() >= 2 && ws_pin_thread(0);
+	printf("%d round trips of %d bytes%s\n", round_trips, (int)payload_bytes, pin_threads ? ", threads pinned" : "");
+
+	for (const Transport& t : transports)
+		for (const Profile& p : profiles)
+			run(t, p, round_trips, payload_bytes);
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+	return 0;
+}
@@ -0,0 +1,189 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include "mini_ws/mini_ws.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _WIN32
+#include <WinSock2.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+// Latency of quiet clients while another client floods the server, all served by one thread.
+// 'drain' is the naive loop polling each connection until it has nothing buffered,
+// 'poller' uses WsPoller with a read budget per tick.
+//
+// Usage: bench_fairness [quiet_clients] [probes] [frames_per_tick]
+
+using Clock = std::chrono::steady_clock;
+
+static const int port = 7452;
+static std::atomic<bool> done;
+
+// Some work per flood message, like parsing it
+static void work(const WsEvent& evt) {
+	volatile uint32_t h = 0;
+	for (size_t i = 0; i < evt.payload_len; ++i)
+		h = h * 31 + evt.payload[i];
+}
+
+static void handle(WsConn* conn, const WsEvent& evt) {
+	if (evt.type == WS_EVT_TEXT)
+		ws_conn_send_text(conn, (const char*)evt.payload, evt.payload_len);
+	else if (evt.type == WS_EVT_BINARY)
+		work(evt);
+}
+
+static void serveDrain(std::vector<WsConn*>& conns) {
+	WsEvent evt;
+	while (!done) {
+		for (WsConn*& conn : conns) {
+			while (conn && ws_conn_poll_event(&conn, &evt, 0))
+				if (conn)
+					handle(conn, evt);
+		}
+	}
+}
+
+static void servePoller(std::vector<WsConn*>& conns, int frames_per_tick) {
+	WsPoller* poller = ws_poller_create(frames_per_tick, 0);
+	for (size_t i = 0; i < conns.size(); ++i)
+		ws_poller_add(poller, conns[i], &conns[i]);
+	WsEvent evt;
+	WsConn* conn;
+	void* user_data;
+	while (!done) {
+		if (!ws_poller_poll_event(poller, &conn, &user_data, &evt, 1000))
+			continue;
+		if (conn)
+			handle(conn, evt);
+		else
+			*(WsConn**)user_data = NULL;
+	}
+	ws_poller_destroy(poller);
+}
+
+static void flooder(WsConn* conn) {
+	std::vector<uint8_t> payload(256, 0x5a);
+	while (!done && ws_conn_send_binary(conn, payload.data(), payload.size()))
+		;
+	ws_conn_destroy(conn);
+}
+
+// A starved probe is given up after a second, the late answers are skipped by their number
+static void quiet(WsConn* conn, int probes, std::vector<double>* samples) {
+	WsEvent evt;
+	for (int i = 0; i < probes && conn; ++i) {
+		char probe[32];
+		int len = snprintf(probe, sizeof(probe), "probe %d", i);
+		auto t0 = Clock::now();
+		auto deadline = t0 + std::chrono::seconds(1);
+		ws_conn_send_text(conn, probe, len);
+		while (conn && Clock::now() < deadline) {
+			if (ws_conn_poll_event(&conn, &evt, 100000) && evt.type == WS_EVT_TEXT
+				&& evt.payload_len == (size_t)len && memcmp(evt.payload, probe, len) == 0)
+				break;
+		}
+		samples->push_back(std::chrono::duration<double, std::micro>(Clock::now() - t0).count());
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	if (conn)
+		ws_conn_destroy(conn);
+}
+
+static double percentile(const std::vector<double>& sorted, double p) {
+	size_t idx = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+	return sorted[idx];
+}
+
+static void run(const char* name, bool use_poller, int num_quiet, int probes, int frames_per_tick) {
+	WsServer* server = ws_server_create(port);
+	if (!server) {
+		printf("Can't create the server\n");
+		return;
+	}
+	done = false;
+
+	// Connections are accepted in the order they are opened, the flooder is the first one
+	std::vector<WsConn*> clients;
+	std::vector<WsConn*> conns;
+	for (int i = 0; i < num_quiet + 1; ++i) {
+		std::thread t([&]() { clients.push_back(ws_client_connect("127.0.0.1", port, NULL, 1000000)); });
+		WsConn* conn = ws_server_accept(server, 1000000);
+		t.join();
+		if (conn && clients.back())
+			conns.push_back(conn);
+		else if (conn)
+			ws_conn_destroy(conn);
+	}
+	if ((int)conns.size() != num_quiet + 1) {
+		printf("Can't connect the clients\n");
+		for (WsConn* conn : clients)
+			if (conn)
+				ws_conn_destroy(conn);
+		for (WsConn* conn : conns)
+			ws_conn_destroy(conn);
+		ws_server_destroy(server);
+		return;
+	}
+
+	std::thread server_thread([&]() {
+		if (use_poller)
+			servePoller(conns, frames_per_tick);
+		else
+			serveDrain(conns);
+	});
+	std::thread flood_thread(flooder, clients[0]);
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+	std::vector<std::vector<double>> samples(num_quiet);
+	std::vector<std::thread> quiet_threads;
+	for (int i = 0; i < num_quiet; ++i)
+		quiet_threads.emplace_back(quiet, clients[i + 1], probes, &samples[i]);
+	for (std::thread& t : quiet_threads)
+		t.join();
+
+	done = true;
+	flood_thread.join();
+	server_thread.join();
+	for (WsConn* conn : conns)
+		if (conn)
+			ws_conn_destroy(conn);
+	ws_server_destroy(server);
+
+	std::vector<double> all;
+	for (const std::vector<double>& s : samples)
+		all.insert(all.end(), s.begin(), s.end());
+	if (all.empty())
+		return;
+	std::sort(all.begin(), all.end());
+	printf("%-8s p50=%9.1f p99=%9.1f max=%9.1f us\n", name, percentile(all, 0.5), percentile(all, 0.99), all.back());
+}
+
+int main(int argc, char** argv)
+{
+#ifdef _WIN32
+	WSADATA wsa_data;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0)
+		return -1;
+#endif
+
+	int num_quiet = argc > 1 ? atoi(argv[1]) : 4;
+	int probes = argc > 2 ? atoi(argv[2]) : 500;
+	int frames_per_tick = argc > 3 ? atoi(argv[3]) : 16;
+	printf("%d quiet clients x %d probes, 1 flooding client\n", num_quiet, probes);
+
+	run("drain", false, num_quiet, probes, frames_per_tick);
+	run("poller", true, num_quiet, probes, frames_per_tick);
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+	return 0;
+}
@@ -0,0 +1,72 @@
+#include "mini_ws/mini_ws.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <chrono>
+#include <vector>
+
+// Cost of the framing layer alone: encode, mask, parse and unmask over the in-memory
+// transport, without any kernel call.
+//
+// Usage: bench_framing [megabytes_per_size]
+
+using Clock = std::chrono::steady_clock;
+
+// Sends count messages from one end and polls them on the other. Returns false on error
+static bool run(WsConn* from, WsConn*& to, const std::vector<uint8_t>& payload, int count) {
+	WsEvent evt;
+	for (int i = 0; i < count; ++i) {
+		if (!ws_conn_send_binary(from, payload.data(), payload.size()))
+			return false;
+		while (true) {
+			if (ws_conn_poll_event(&to, &evt, 0)) {
+				if (evt.type == WS_EVT_BINARY && evt.payload_len == payload.size())
+					break;
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	double megabytes = argc > 1 ? atof(argv[1]) : 256.0;
+	static const size_t sizes[] = { 16, 128, 1024, 16 * 1024, 65535 };
+
+	WsConn* client = NULL;
+	WsConn* server = NULL;
+	if (!ws_mem_pair_create(&client, &server)) {
+		printf("Can't create the memory pair\n");
+		return -1;
+	}
+
+	printf("%-8s %-18s %12s %10s %10s\n", "bytes", "direction", "msgs/s", "MB/s", "ns/msg");
+	for (size_t size : sizes) {
+		std::vector<uint8_t> payload(size);
+		for (size_t i = 0; i < size; ++i)
+			payload[i] = (uint8_t)i;
+		int count = (int)(megabytes * 1024 * 1024 / size);
+		if (count > 2000000)
+			count = 2000000;
+
+		for (int dir = 0; dir < 2; ++dir) {
+			// Client frames are masked, server frames are not
+			WsConn* from = dir == 0 ? client : server;
+			WsConn*& to = dir == 0 ? server : client;
+			Clock::time_point t0 = Clock::now();
+			if (!run(from, to, payload, count)) {
+				printf("Failed at %d bytes\n", (int)size);
+				return -1;
+			}
+			double secs = std::chrono::duration<double>(Clock::now() - t0).count();
+			printf("%-8d %-18s %12.0f %10.1f %10.1f\n", (int)size, dir == 0 ? "client->server" : "server->client",
+				count / secs, count * (double)size / secs / (1024 * 1024), secs * 1e9 / count);
+		}
+	}
+
+	ws_conn_destroy(client);
+	ws_conn_destroy(server);
+	return 0;
+}
@@ -3,16 +3,15 @@
 #include "mini_ws/mini_ws.h"
 
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
 #ifdef _WIN32
 #include <WinSock2.h>
-#define sleep_ms(ms) Sleep(ms)
-#else
-#include <unistd.h>
-#define sleep_ms(ms) usleep((ms)*1000)
 #endif
 
+#include <chrono>
+#include <cmath>
 #include <vector>
 
 class Png : std::vector< uint8_t > {
@@ -33,11 +32,70 @@ public:
 	void send(WsConn* conn) {
 		ws_conn_send_binary(conn, data(), size());
 	}
+	void queue(WsConn* conn) {
+		ws_conn_queue_binary(conn, data(), size(), WS_PRIORITY_LOW);
+	}
 };
 
 Png pngs[2];
 
-int main()
+// Raw RGBA image where only a few bars move, sent with the delta channel. web_client.html draws it
+class Dashboard {
+public:
+	static const int width = 128;
+	static const int height = 64;
+	static const uint32_t key = 1;
+
+	Dashboard() : rgba(width * height * 4, 32) {}
+	void update(int frame) {
+		for (int bar = 0; bar < 8; ++bar) {
+			int h = (int)((0.5 + 0.4 * sin(frame * 0.05 + bar)) * height);
+			for (int y = 0; y < height; ++y) {
+				for (int x = bar * 16 + 2; x < bar * 16 + 14; ++x) {
+					uint8_t* p = &rgba[(y * width + x) * 4];
+					bool on = y >= height - h;
+					p[0] = on ? 40 : 32;
+					p[1] = on ? (uint8_t)(120 + bar * 16) : 32;
+					p[2] = on ? 220 : 32;
+					p[3] = 255;
+				}
+			}
+		}
+	}
+	void send(WsConn* conn) {
+		ws_conn_send_delta(conn, key, rgba.data(), rgba.size());
+	}
+private:
+	std::vector<uint8_t> rgba;
+};
+
+// The page is served from the ws port too, open http://127.0.0.1:7450/
+static void addPage(WsServer* server, const char* filename) {
+	FILE* f = fopen(filename, "rb");
+	if (!f)
+		return;
+	std::vector<char> html;
+	char buf[4096];
+	while (size_t n = fread(buf, 1, sizeof(buf), f))
+		html.insert(html.end(), buf, buf + n);
+	fclose(f);
+	ws_server_add_asset(server, "/", "text/html; charset=utf-8", html.data(), html.size(), 0);
+	ws_server_add_asset(server, "/web_client.html", "text/html; charset=utf-8", html.data(), html.size(), 0);
+}
+
+static bool parseProfile(const char* name, WsServerProfile* out) {
+	if (strcmp(name, "default") == 0) *out = WS_PROFILE_DEFAULT;
+	else if (strcmp(name, "low-latency") == 0) *out = WS_PROFILE_LOW_LATENCY;
+	else if (strcmp(name, "high-throughput") == 0) *out = WS_PROFILE_HIGH_THROUGHPUT;
+	else if (strcmp(name, "busy-poll") == 0) *out = WS_PROFILE_BUSY_POLL;
+	else return false;
+	return true;
+}
+
+// Usage: demo [default|low-latency|high-throughput|busy-poll] [record.log]
+// Use the 'Latency test' button of web_client.html to compare the profiles
+// The sessions recorded in record.log can be replayed with replay.cpp
+int main(int argc, char** argv)
 {
 #ifdef _WIN32
 	WSADATA wsa_data;
@@ -48,10 +106,30 @@ int main()
 	pngs[0].readFromFile("img00.png");
 	pngs[1].readFromFile("img01.png");
 
-	WsServer* ws_server = ws_server_create(7450);
+	const char* profile_name = argc > 1 ? argv[1] : "default";
+	WsServerProfile profile;
+	if (!parseProfile(profile_name, &profile)) {
+		printf("Unknown profile %s. Use default, low-latency, high-throughput or busy-poll\n", profile_name);
+		return -1;
+	}
+	if (profile == WS_PROFILE_BUSY_POLL)
+		ws_pin_thread(0);
+
+	WsServerConfig cfg;
+	ws_server_config_init(&cfg, profile);
+	WsServer* ws_server = ws_server_create_ex(7450, &cfg);
 	if (!ws_server)
 		return -1;
-	printf("ws server started\n");
+	printf("ws server started. Profile %s\n", profile_name);
+	addPage(ws_server, "web_client.html");
+
+	WsRecorder* recorder = NULL;
+	if (argc > 2) {
+		recorder = ws_recorder_create(argv[2]);
+		if (!recorder)
+			printf("Can't record to %s\n", argv[2]);
+		ws_server_set_recorder(ws_server, recorder);
+	}
 
 	while (true) {
 		printf(".");
@@ -61,10 +139,29 @@ int main()
 			printf("ws connection accepted: fd=%d\n", conn->fd);
 
 			WsEvent evt;
+			bool pending = false;		// queued pngs still going out
+			Dashboard dashboard;
+			int dashboard_frames = 0;	// left to send, one every 16ms
+			auto next_frame = std::chrono::steady_clock::now();
 			while( true ) {
 
-				if (ws_conn_poll_event(&conn, &evt, 1000000)) {
+				int max_usecs = pending ? 0 : dashboard_frames ? 16000 : 1000000;
+				if (ws_conn_poll_event(&conn, &evt, max_usecs)) {
 					if (evt.type == WS_EVT_TEXT) {
+						// Round trip probes from the web client, answer asap and don't log
+						if (evt.payload_len >= 4 && strncmp((char*)evt.payload, "echo", 4) == 0) {
+							ws_conn_send_text(conn, (const char*)evt.payload, evt.payload_len);
+							continue;
+						}
+						// The client lost track of a delta key
+						if (evt.payload_len > 9 && strncmp((char*)evt.payload, "keyframe ", 9) == 0) {
+							// The payload is not null-terminated
+							uint32_t key = 0;
+							for (size_t i = 9; i < evt.payload_len && evt.payload[i] >= '0' && evt.payload[i] <= '9'; ++i)
+								key = key * 10 + (evt.payload[i] - '0');
+							ws_conn_delta_request_keyframe(conn, key);
+							continue;
+						}
 						printf("Event: text frame: %.*s\n", (int)evt.payload_len, evt.payload);
 						ws_conn_send_text(conn, "Hello, WebSocket!", 18);
 
@@ -73,13 +170,16 @@ int main()
 						else if (strncmp((char*)evt.payload, "png1", 4) == 0)
 							pngs[1].send(conn);
 						else if (strncmp((char*)evt.payload, "pngs", 4) == 0) {
+							// Sent a fragment per loop, the echo probes are still answered meanwhile
 							for (int i = 0; i < 10; ++i) {
-								for (int j = 0; j < 2; ++j) {
-									pngs[j].send(conn);
-									sleep_ms(16);
-								}
+								for (int j = 0; j < 2; ++j)
+									pngs[j].queue(conn);
 							}
 						}
+						else if (strncmp((char*)evt.payload, "deltas", 6) == 0) {
+							dashboard_frames = 600;
+							next_frame = std::chrono::steady_clock::now();
+						}
 
 					}
 					else if (evt.type == WS_EVT_BINARY) {
@@ -92,12 +192,19 @@ int main()
 						break;
 					}
 				}
+				if (dashboard_frames && std::chrono::steady_clock::now() >= next_frame) {
+					dashboard.update(600 - dashboard_frames--);
+					dashboard.send(conn);
+					next_frame += std::chrono::milliseconds(16);
+				}
+				pending = ws_conn_flush(conn, 0) == 0;
 
 			}
 		}
 	}
 
 	ws_server_destroy( ws_server );
+	ws_recorder_destroy( recorder );
 
 #ifdef _WIN32
 	WSACleanup();
@@ -0,0 +1,121 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include "mini_ws/mini_ws.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// Same commands as demo.cpp, but any number of clients are served at the same time
+// by a single thread using the coroutine layer.
+
+using namespace std::chrono_literals;
+
+class Png : std::vector< uint8_t > {
+public:
+	bool readFromFile(const char* filename) {
+		FILE* f = fopen(filename, "rb");
+		if (f) {
+			fseek(f, 0, SEEK_END);
+			size_t size = ftell(f);
+			fseek(f, 0, SEEK_SET);
+			resize(size);
+			fread(data(), 1, size, f);
+			fclose(f);
+			return true;
+		}
+		return false;
+	}
+	mini_ws::Task<bool> send(mini_ws::Conn& conn) const {
+		bool ok = co_await conn.send({ data(), size() });
+		co_return ok;
+	}
+};
+
+Png pngs[2];
+
+static mini_ws::Task<> session(mini_ws::Scheduler& sched, mini_ws::Conn conn) {
+	int fd = conn.get()->fd;
+	printf("ws connection accepted: fd=%d\n", fd);
+
+	while (true) {
+		mini_ws::Message msg = co_await conn.recv();
+		if (msg.closed())
+			break;
+
+		if (msg.type == WS_EVT_BINARY) {
+			printf("Event: binary frame: %d bytes\n", (int)msg.payload.size());
+			static const uint8_t data[4] = { 'A', 'B', 'C', 'D' };
+			co_await conn.send(data);
+			continue;
+		}
+
+		std::string_view text = msg.text();
+		if (text.starts_with("echo")) {
+			co_await conn.sendText(text);
+			continue;
+		}
+
+		printf("Event: text frame (fd=%d): %.*s\n", fd, (int)text.size(), text.data());
+		co_await conn.sendText("Hello, WebSocket!");
+
+		if (text.starts_with("png0"))
+			co_await pngs[0].send(conn);
+		else if (text.starts_with("png1"))
+			co_await pngs[1].send(conn);
+		else if (text.starts_with("pngs")) {
+			// Other clients keep being served during the sleeps
+			for (int i = 0; i < 10; ++i) {
+				for (int j = 0; j < 2; ++j) {
+					co_await pngs[j].send(conn);
+					co_await sched.sleep(16ms);
+				}
+			}
+		}
+	}
+	printf("Event: connection closed fd=%d\n", fd);
+}
+
+static mini_ws::Task<> acceptLoop(mini_ws::Scheduler& sched, mini_ws::Server& server) {
+	while (true) {
+		mini_ws::Conn conn = co_await server.accept();
+		if (!conn)
+			break;
+		sched.spawn(session(sched, std::move(conn)));
+	}
+}
+
+int main()
+{
+#ifdef _WIN32
+	WSADATA wsa_data;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0)
+		return -1;
+#endif
+
+	pngs[0].readFromFile("img00.png");
+	pngs[1].readFromFile("img01.png");
+
+	mini_ws::Scheduler sched;
+	mini_ws::Server server(sched, 7450);
+	if (!server)
+		return -1;
+	printf("ws server started\n");
+
+	// Same page as demo.cpp, from the ws port
+	std::vector<char> html;
+	if (FILE* f = fopen("web_client.html", "rb")) {
+		char buf[4096];
+		while (size_t n = fread(buf, 1, sizeof(buf), f))
+			html.insert(html.end(), buf, buf + n);
+		fclose(f);
+		ws_server_add_asset(server.get(), "/", "text/html; charset=utf-8", html.data(), html.size(), 0);
+	}
+
+	sched.spawn(acceptLoop(sched, server));
+	sched.run();
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+	return 0;
+}
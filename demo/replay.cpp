@@ -0,0 +1,223 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include "mini_ws/mini_ws.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _WIN32
+#include <WinSock2.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Replays the sessions of a log written by ws_recorder_create against a server.
+//
+// Each recorded connection is replayed by its own client. The frames the server received
+// are sent again, and every frame the server sent is awaited before continuing, so the
+// latency is measured from the last frame sent until each answer arrives.
+//
+// Usage: replay <log> <address> <port> [--max-speed] [--repeat N]
+//   --max-speed  don't wait between frames (default replays at 1x)
+//   --repeat N   open N concurrent clients per recorded session
+
+using Clock = std::chrono::steady_clock;
+
+struct Record {
+	uint64_t       usecs;
+	WsRecordKind   kind;
+	uint8_t        opcode;
+	const uint8_t* payload;
+	uint32_t       len;
+};
+
+struct Stats {
+	uint64_t            sent = 0;
+	uint64_t            received = 0;
+	uint64_t            bytes_sent = 0;
+	uint64_t            bytes_received = 0;
+	uint64_t            failed_sessions = 0;
+	std::vector<double> latencies;			// usecs
+
+	void add(const Stats& other) {
+		sent += other.sent;
+		received += other.received;
+		bytes_sent += other.bytes_sent;
+		bytes_received += other.bytes_received;
+		failed_sessions += other.failed_sessions;
+		latencies.insert(latencies.end(), other.latencies.begin(), other.latencies.end());
+	}
+};
+
+static uint32_t readLe32(const uint8_t* p) {
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t readLe64(const uint8_t* p) {
+	return (uint64_t)readLe32(p) | ((uint64_t)readLe32(p + 4) << 32);
+}
+
+static bool loadLog(const char* filename, std::vector<uint8_t>& data, std::map<uint32_t, std::vector<Record>>& sessions) {
+	FILE* f = fopen(filename, "rb");
+	if (!f)
+		return false;
+	fseek(f, 0, SEEK_END);
+	size_t size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	data.resize(size);
+	size_t n = fread(data.data(), 1, size, f);
+	fclose(f);
+	if (n != size || size < 8 || memcmp(data.data(), WS_RECORD_MAGIC, 8) != 0)
+		return false;
+
+	size_t off = 8;
+	while (off + WS_RECORD_HEADER_SIZE <= size) {
+		const uint8_t* p = data.data() + off;
+		Record r;
+		r.usecs = readLe64(p);
+		uint32_t id = readLe32(p + 8);
+		r.len = readLe32(p + 12);
+		r.kind = (WsRecordKind)p[16];
+		r.opcode = p[17];
+		r.payload = p + WS_RECORD_HEADER_SIZE;
+		if (id == 0 || r.kind < WS_REC_OPEN || r.kind > WS_REC_CLOSE)
+			break;		// end marker of a log not closed properly
+		if (off + WS_RECORD_HEADER_SIZE + r.len > size)
+			break;
+		sessions[id].push_back(r);
+		off += WS_RECORD_HEADER_SIZE + r.len;
+	}
+	return true;
+}
+
+static void replaySession(const std::vector<Record>& records, const char* address, int port, bool max_speed, Stats& stats) {
+	WsServerConfig cfg;
+	ws_server_config_init(&cfg, WS_PROFILE_LOW_LATENCY);
+	WsConn* conn = ws_client_connect(address, port, &cfg, 2000000);
+	if (!conn) {
+		stats.failed_sessions++;
+		return;
+	}
+
+	Clock::time_point start = Clock::now();
+	Clock::time_point last_send = start;
+	uint64_t base = records.empty() ? 0 : records.front().usecs;
+
+	for (const Record& r : records) {
+		if (!conn)
+			break;
+
+		if (r.kind == WS_REC_IN && (r.opcode == 1 || r.opcode == 2)) {
+			if (!max_speed)
+				std::this_thread::sleep_until(start + std::chrono::microseconds(r.usecs - base));
+			last_send = Clock::now();
+			bool ok = (r.opcode == 1)
+				? ws_conn_send_text(conn, (const char*)r.payload, r.len)
+				: ws_conn_send_binary(conn, r.payload, r.len);
+			if (!ok)
+				break;
+			stats.sent++;
+			stats.bytes_sent += r.len;
+		}
+		else if (r.kind == WS_REC_OUT && (r.opcode == 1 || r.opcode == 2)) {
+			WsEvent evt;
+			Clock::time_point deadline = Clock::now() + std::chrono::seconds(5);
+			bool got = false;
+			while (conn && !got && Clock::now() < deadline) {
+				if (!ws_conn_poll_event(&conn, &evt, 100000))
+					continue;
+				if (evt.type == WS_EVT_TEXT || evt.type == WS_EVT_BINARY) {
+					got = true;
+					stats.received++;
+					stats.bytes_received += evt.payload_len;
+					stats.latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - last_send).count());
+				}
+			}
+			if (!got)
+				break;
+		}
+		else if (r.kind == WS_REC_CLOSE || (r.kind == WS_REC_IN && r.opcode == 8)) {
+			break;
+		}
+	}
+
+	if (conn)
+		ws_conn_destroy(conn);
+}
+
+static double percentile(const std::vector<double>& sorted, double p) {
+	size_t idx = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+	return sorted[idx];
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 4) {
+		printf("Usage: replay <log> <address> <port> [--max-speed] [--repeat N]\n");
+		return -1;
+	}
+	const char* log = argv[1];
+	const char* address = argv[2];
+	int port = atoi(argv[3]);
+	bool max_speed = false;
+	int repeat = 1;
+	for (int i = 4; i < argc; ++i) {
+		if (strcmp(argv[i], "--max-speed") == 0)
+			max_speed = true;
+		else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+			repeat = std::max(1, atoi(argv[++i]));
+	}
+
+#ifdef _WIN32
+	WSADATA wsa_data;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0)
+		return -1;
+#endif
+
+	std::vector<uint8_t> data;
+	std::map<uint32_t, std::vector<Record>> sessions;
+	if (!loadLog(log, data, sessions)) {
+		printf("Can't read %s\n", log);
+		return -1;
+	}
+	printf("%d sessions x %d clients, %s\n", (int)sessions.size(), repeat, max_speed ? "max speed" : "1x");
+
+	Stats total;
+	std::mutex total_mutex;
+	std::vector<std::thread> clients;
+	Clock::time_point t0 = Clock::now();
+	for (const auto& it : sessions) {
+		for (int i = 0; i < repeat; ++i) {
+			clients.emplace_back([&, records = &it.second]() {
+				Stats stats;
+				replaySession(*records, address, port, max_speed, stats);
+				std::lock_guard<std::mutex> lock(total_mutex);
+				total.add(stats);
+			});
+		}
+	}
+	for (std::thread& t : clients)
+		t.join();
+	double secs = std::chrono::duration<double>(Clock::now() - t0).count();
+
+	printf("elapsed %.3f s, %d failed sessions\n", secs, (int)total.failed_sessions);
+	printf("sent     %llu msgs %.2f MB  (%.0f msgs/s %.2f MB/s)\n",
+		(unsigned long long)total.sent, total.bytes_sent / 1e6, total.sent / secs, total.bytes_sent / 1e6 / secs);
+	printf("received %llu msgs %.2f MB  (%.0f msgs/s %.2f MB/s)\n",
+		(unsigned long long)total.received, total.bytes_received / 1e6, total.received / secs, total.bytes_received / 1e6 / secs);
+	if (!total.latencies.empty()) {
+		std::sort(total.latencies.begin(), total.latencies.end());
+		printf("latency  p50=%.1f p99=%.1f max=%.1f us\n",
+			percentile(total.latencies, 0.5), percentile(total.latencies, 0.99), total.latencies.back());
+	}
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+	return 0;
+}
@@ -1,13 +1,22 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     // sched_setaffinity(), ppoll()
+#endif
+
 #include "mini_ws.h"
 
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>      // tolower()
+#include <stddef.h>     // offsetof()
+#include <time.h>
 
 #ifdef _WIN32
 #include <winsock2.h>
+#include <ws2tcpip.h>
+#include <afunix.h>
 #pragma comment(lib, "ws2_32.lib")
 typedef int socklen_t;
 #else
@@ -15,19 +24,52 @@ typedef int socklen_t;
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
+#include <sys/mman.h>
+#include <poll.h>
+#endif
+
+#ifdef __linux__
+#include <sched.h>
 #endif
 
 #ifndef MIN
 #define MIN(a,b) ((a)<(b)?(a):(b))
 #endif
 
+// Writing to a socket closed by the peer must fail with EPIPE, not kill the process
+#ifdef MSG_NOSIGNAL
+#define WS_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define WS_SEND_FLAGS 0
+#endif
+
+#ifndef WS_RECORD_SEGMENT
+#define WS_RECORD_SEGMENT (16u * 1024u * 1024u) // mmap window of the recorder
+#endif
+
 #ifndef WS_MAX_SEND_FRAME
 #define WS_MAX_SEND_FRAME (64u * 1024u * 1024u) // 64MB
 #endif
 
+#ifndef WS_MAX_RECV_MESSAGE
+#define WS_MAX_RECV_MESSAGE (64u * 1024u * 1024u) // reassembled fragments
+#endif
+
+// Largest frame accepted plus its header. The read buffer never holds more, complete frames are parsed
+// before reading again
+#define WS_MAX_READ_BUFFER ((size_t)WS_MAX_RECV_MESSAGE + 14)
+
+#ifndef WS_DEFAULT_FRAGMENT_SIZE
+#define WS_DEFAULT_FRAGMENT_SIZE (16u * 1024u)    // queued messages, bounds the wait of control frames
+#endif
+
 // ===================== SHA1 (small) =====================
 
 typedef struct {
@@ -141,6 +183,148 @@ static size_t base64_encode(const uint8_t* in, size_t in_len, char* out, size_t
     return o;
 }
 
+
+// ===================== Gzip (small) =====================
+// Deflate with LZ77 and the fixed Huffman codes, a single block. Used once per asset at
+// registration, so it favors size of the code over ratio and speed.
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t* p, size_t n) {
+    crc = ~crc;
+    for (size_t i = 0; i < n; i++) {
+        crc ^= p[i];
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1u)));
+    }
+    return ~crc;
+}
+
+typedef struct {
+    uint8_t* out;
+    size_t   size;
+    size_t   cap;
+    uint32_t bits;
+    int      nbits;
+} deflate_writer;
+
+// Deflate packs the bits LSB first
+static void deflate_put_bits(deflate_writer* w, uint32_t value, int n) {
+    w->bits |= value << w->nbits;
+    w->nbits += n;
+    while (w->nbits >= 8) {
+        if (w->size < w->cap) w->out[w->size] = (uint8_t)w->bits;
+        w->size++;
+        w->bits >>= 8;
+        w->nbits -= 8;
+    }
+}
+
+// Huffman codes go MSB first
+static void deflate_put_code(deflate_writer* w, uint32_t code, int n) {
+    uint32_t rev = 0;
+    for (int i = 0; i < n; i++)
+        rev |= ((code >> i) & 1u) << (n - 1 - i);
+    deflate_put_bits(w, rev, n);
+}
+
+static void deflate_put_symbol(deflate_writer* w, int sym) {
+    if (sym < 144)      deflate_put_code(w, 0x30u + sym, 8);
+    else if (sym < 256) deflate_put_code(w, 0x190u + (sym - 144), 9);
+    else if (sym < 280) deflate_put_code(w, (uint32_t)(sym - 256), 7);
+    else                deflate_put_code(w, 0xC0u + (sym - 280), 8);
+}
+
+static const uint16_t deflate_len_base[29] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+static const uint8_t  deflate_len_extra[29] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+static const uint16_t deflate_dist_base[30] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+static const uint8_t  deflate_dist_extra[30] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+
+static void deflate_put_match(deflate_writer* w, int len, int dist) {
+    int i = 28;
+    while (deflate_len_base[i] > len) i--;
+    deflate_put_symbol(w, 257 + i);
+    deflate_put_bits(w, (uint32_t)(len - deflate_len_base[i]), deflate_len_extra[i]);
+    int d = 29;
+    while (deflate_dist_base[d] > dist) d--;
+    deflate_put_code(w, (uint32_t)d, 5);
+    deflate_put_bits(w, (uint32_t)(dist - deflate_dist_base[d]), deflate_dist_extra[d]);
+}
+
+#define DEFLATE_WINDOW    32768
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_MAX_CHAIN 64
+
+// Returns the gzip stream, or NULL if it's not smaller than the input. free() it
+static uint8_t* gzip_compress(const uint8_t* in, size_t n, size_t* out_len) {
+    size_t cap = n + n / 8 + 64;
+    deflate_writer w = { (uint8_t*)malloc(cap), 0, cap, 0, 0 };
+    int32_t* head = (int32_t*)malloc(sizeof(int32_t) << DEFLATE_HASH_BITS);
+    int32_t* prev = (int32_t*)malloc(sizeof(int32_t) * DEFLATE_WINDOW);
+    if (!w.out || !head || !prev || n > (size_t)INT32_MAX) {
+        free(w.out); free(head); free(prev);
+        return NULL;
+    }
+    for (int i = 0; i < (1 << DEFLATE_HASH_BITS); i++) head[i] = -1;
+
+    static const uint8_t gz_header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff };
+    for (int i = 0; i < 10; i++) deflate_put_bits(&w, gz_header[i], 8);
+    deflate_put_bits(&w, 1, 1);     // BFINAL
+    deflate_put_bits(&w, 1, 2);     // BTYPE 01, fixed Huffman
+
+    size_t pos = 0;
+    while (pos < n) {
+        int best_len = 0, best_dist = 0;
+        uint32_t h = 0;
+        if (pos + 2 < n) {
+            h = (((uint32_t)in[pos] << 16) | ((uint32_t)in[pos + 1] << 8) | in[pos + 2]) * 2654435761u >> (32 - DEFLATE_HASH_BITS);
+            int32_t cand = head[h];
+            size_t max_len = MIN((size_t)258, n - pos);
+            for (int chain = 0; cand >= 0 && pos - (size_t)cand <= DEFLATE_WINDOW && chain < DEFLATE_MAX_CHAIN; chain++) {
+                size_t l = 0;
+                while (l < max_len && in[cand + l] == in[pos + l]) l++;
+                if ((int)l > best_len) {
+                    best_len = (int)l;
+                    best_dist = (int)(pos - (size_t)cand);
+                    if (l == max_len) break;
+                }
+                cand = prev[cand & (DEFLATE_WINDOW - 1)];
+            }
+        }
+
+        size_t advance = 1;
+        if (best_len >= 3) {
+            deflate_put_match(&w, best_len, best_dist);
+            advance = (size_t)best_len;
+        }
+        else {
+            deflate_put_symbol(&w, in[pos]);
+        }
+
+        // Insert every position consumed into the hash chains
+        for (size_t k = 0; k < advance; k++, pos++) {
+            if (pos + 2 >= n) continue;
+            h = (((uint32_t)in[pos] << 16) | ((uint32_t)in[pos + 1] << 8) | in[pos + 2]) * 2654435761u >> (32 - DEFLATE_HASH_BITS);
+            prev[pos & (DEFLATE_WINDOW - 1)] = head[h];
+            head[h] = (int32_t)pos;
+        }
+    }
+    deflate_put_symbol(&w, 256);    // end of block
+    if (w.nbits) deflate_put_bits(&w, 0, 8 - w.nbits);
+
+    uint32_t crc = crc32_update(0, in, n);
+    for (int i = 0; i < 4; i++) deflate_put_bits(&w, (crc >> (8 * i)) & 0xFF, 8);
+    for (int i = 0; i < 4; i++) deflate_put_bits(&w, (uint32_t)(n >> (8 * i)) & 0xFF, 8);
+
+    free(head);
+    free(prev);
+    if (w.size >= n || w.size > w.cap) {
+        free(w.out);
+        return NULL;
+    }
+    *out_len = w.size;
+    return w.out;
+}
+
+
 // ===================== Helpers =====================
 
 static int set_reuseaddr(int fd) {
@@ -148,40 +332,281 @@ static int set_reuseaddr(int fd) {
     return setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char*) &yes, sizeof(yes));
 }
 
-static int wait_fd(int fd, int for_read, int max_usecs) {
-    fd_set rfds, wfds;
-    FD_ZERO(&rfds); FD_ZERO(&wfds);
-    if (for_read) FD_SET(fd, &rfds); else FD_SET(fd, &wfds);
+static int set_int_opt(int fd, int level, int name, int value) {
+    return setsockopt(fd, level, name, (const char*)&value, sizeof(value));
+}
+
+static void set_nosigpipe(int fd) {
+#ifdef SO_NOSIGPIPE
+    set_int_opt(fd, SOL_SOCKET, SO_NOSIGPIPE, 1);
+#else
+    (void)fd;
+#endif
+}
+
+static void set_quickack(int fd) {
+#ifdef TCP_QUICKACK
+    set_int_opt(fd, IPPROTO_TCP, TCP_QUICKACK, 1);
+#else
+    (void)fd;
+#endif
+}
+
+// Best effort, failures are ignored like SO_REUSEADDR
+static void apply_socket_config(int fd, int family, const WsServerConfig* cfg) {
+    if (cfg->sndbuf_bytes > 0)
+        set_int_opt(fd, SOL_SOCKET, SO_SNDBUF, cfg->sndbuf_bytes);
+    if (cfg->rcvbuf_bytes > 0)
+        set_int_opt(fd, SOL_SOCKET, SO_RCVBUF, cfg->rcvbuf_bytes);
+    // Nothing else applies to unix sockets
+    if (family == AF_UNIX)
+        return;
+    if (cfg->tcp_nodelay)
+        set_int_opt(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+    if (cfg->tcp_quickack)
+        set_quickack(fd);
+#ifdef SO_BUSY_POLL
+    if (cfg->busy_poll_usecs > 0)
+        set_int_opt(fd, SOL_SOCKET, SO_BUSY_POLL, cfg->busy_poll_usecs);
+#endif
+    if (cfg->keepalive) {
+        set_int_opt(fd, SOL_SOCKET, SO_KEEPALIVE, 1);
+#ifdef TCP_KEEPIDLE
+        if (cfg->keepalive_idle_secs > 0)
+            set_int_opt(fd, IPPROTO_TCP, TCP_KEEPIDLE, cfg->keepalive_idle_secs);
+#endif
+#ifdef TCP_KEEPINTVL
+        if (cfg->keepalive_interval_secs > 0)
+            set_int_opt(fd, IPPROTO_TCP, TCP_KEEPINTVL, cfg->keepalive_interval_secs);
+#endif
+#ifdef TCP_KEEPCNT
+        if (cfg->keepalive_count > 0)
+            set_int_opt(fd, IPPROTO_TCP, TCP_KEEPCNT, cfg->keepalive_count);
+#endif
+    }
+}
+
+bool ws_pin_thread(int cpu) {
+    if (cpu < 0) return false;
+#if defined(_WIN32)
+    if (cpu >= (int)(sizeof(DWORD_PTR) * 8)) return false;
+    return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0;
+#elif defined(__linux__)
+    if (cpu >= CPU_SETSIZE) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;     // 0 is the calling thread
+#else
+    return false;       // osx only has affinity hints
+#endif
+}
+
+static uint64_t ws_now_usecs(void) {
+#ifdef _WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000u
+        + (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000u / (uint64_t)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)(ts.tv_nsec / 1000);
+#endif
+}
+
+static void write_le32(uint8_t* p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = (uint8_t)(v >> (i * 8));
+}
+
+static void write_le64(uint8_t* p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = (uint8_t)(v >> (i * 8));
+}
+
+static int set_nonblocking(int fd, int on) {
+#ifdef _WIN32
+    u_long mode = on ? 1 : 0;
+    return ioctlsocket((SOCKET)fd, FIONBIO, &mode);
+#else
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK));
+#endif
+}
+
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t len;
+} WsSockAddr;
+
+// See the address formats in mini_ws.h. Returns the family or -1
+static int resolve_address(const char* address, int port, WsSockAddr* out) {
+    memset(out, 0, sizeof(*out));
+
+    if (!address || !address[0]) {
+        struct sockaddr_in* sin = (struct sockaddr_in*)&out->addr;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons((uint16_t)port);
+        sin->sin_addr.s_addr = htonl(INADDR_ANY);
+        out->len = sizeof(*sin);
+        return AF_INET;
+    }
+
+    if (strncmp(address, "unix:", 5) == 0) {
+        const char* path = address + 5;
+        struct sockaddr_un* sun = (struct sockaddr_un*)&out->addr;
+        size_t n = strlen(path);
+        if (n == 0 || n >= sizeof(sun->sun_path)) return -1;
+        sun->sun_family = AF_UNIX;
+        memcpy(sun->sun_path, path, n);
+        out->len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + n + 1);
+        if (path[0] == '@') {
+#ifdef __linux__
+            // Abstract names are not null-terminated, the length is part of the name
+            sun->sun_path[0] = '\0';
+            out->len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + n);
+#else
+            return -1;
+#endif
+        }
+        return AF_UNIX;
+    }
+
+    char port_str[16];
+    snprintf(port_str, sizeof(port_str), "%d", port);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* res = NULL;
+    if (getaddrinfo(address, port_str, &hints, &res) != 0 || !res) return -1;
+    int family = -1;
+    if (res->ai_addrlen <= sizeof(out->addr)) {
+        memcpy(&out->addr, res->ai_addr, res->ai_addrlen);
+        out->len = (socklen_t)res->ai_addrlen;
+        family = res->ai_family;
+    }
+    freeaddrinfo(res);
+    return family;
+}
+
+// poll() instead of select(), FD_SET can't take fds >= FD_SETSIZE
+#ifdef _WIN32
+typedef WSAPOLLFD ws_pollfd;
+#else
+typedef struct pollfd ws_pollfd;
+#endif
 
-    struct timeval tv;
-    struct timeval* ptv = NULL;
+// max_usecs < 0 waits forever. Linux keeps the usecs resolution, elsewhere it's rounded up to ms
+static int ws_poll_usecs(ws_pollfd* fds, size_t n, int64_t max_usecs) {
+#if defined(__linux__)
+    struct timespec ts;
     if (max_usecs >= 0) {
-        tv.tv_sec = max_usecs / 1000000;
-        tv.tv_usec = max_usecs % 1000000;
-        ptv = &tv;
+        ts.tv_sec = (time_t)(max_usecs / 1000000);
+        ts.tv_nsec = (long)(max_usecs % 1000000) * 1000;
+    }
+    return ppoll(fds, (nfds_t)n, max_usecs >= 0 ? &ts : NULL, NULL);
+#else
+    int ms = max_usecs < 0 ? -1 : (int)MIN((max_usecs + 999) / 1000, (int64_t)INT_MAX);
+#ifdef _WIN32
+    if (n == 0) {
+        // WSAPoll fails without sockets
+        if (ms > 0) Sleep((DWORD)ms);
+        return 0;
     }
+    return WSAPoll(fds, (ULONG)n, ms);
+#else
+    return poll(fds, (nfds_t)n, ms);
+#endif
+#endif
+}
 
-    int rc = select(fd + 1, for_read ? &rfds : NULL, for_read ? NULL : &wfds, NULL, ptv);
+static int wait_fd(int fd, int for_read, int max_usecs) {
+    ws_pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = for_read ? POLLIN : POLLOUT;
+    pfd.revents = 0;
+    int rc = ws_poll_usecs(&pfd, 1, max_usecs);
     return rc; // 0 timeout, >0 ready, <0 error
 }
 
-static size_t send_all(int fd, const uint8_t* buf, size_t len, int max_usecs) {
-    size_t off = 0;
-    while (off < len) {
+// Returns the bytes sent, 0 on timeout, < 0 on error
+static int send_some(int fd, const uint8_t* buf, size_t len, int max_usecs) {
+    while (true) {
+        int w = wait_fd(fd, 0, max_usecs);
+        if (w <= 0) return w;
+
+        int n = (int)send(fd, (const char*)buf, (int)MIN(len, (size_t)INT_MAX), WS_SEND_FLAGS);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) continue;
+            return -1;
+        }
+        if (n == 0) return -1;
+        return n;
+    }
+}
+
+// Same as send_some for a and b sent together, in a single segment when they fit.
+// Returns the bytes sent, counting from the start of a
+static int send_some2(int fd, const uint8_t* a, size_t alen, const uint8_t* b, size_t blen, int max_usecs) {
+    blen = MIN(blen, (size_t)INT_MAX - alen);
+    while (true) {
         int w = wait_fd(fd, 0, max_usecs);
-        if (w == 0) return -2; // timeout
-        if (w < 0) return -1;
+        if (w <= 0) return w;
 
-        size_t n = send(fd, buf + off, (int)(len - off), 0);
+#ifdef _WIN32
+        WSABUF bufs[2];
+        bufs[0].buf = (char*)a;
+        bufs[0].len = (ULONG)alen;
+        bufs[1].buf = (char*)b;
+        bufs[1].len = (ULONG)blen;
+        DWORD sent = 0;
+        if (WSASend((SOCKET)fd, bufs, 2, &sent, 0, NULL, NULL) != 0) {
+            if (WSAGetLastError() == WSAEWOULDBLOCK) continue;
+            return -1;
+        }
+        int n = (int)sent;
+#else
+        struct iovec iov[2];
+        iov[0].iov_base = (void*)a;
+        iov[0].iov_len = alen;
+        iov[1].iov_base = (void*)b;
+        iov[1].iov_len = blen;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        int n = (int)sendmsg(fd, &msg, WS_SEND_FLAGS);
         if (n < 0) {
             if (errno == EINTR) continue;
             if (errno == EAGAIN || errno == EWOULDBLOCK) continue;
             return -1;
         }
+#endif
         if (n == 0) return -1;
+        return n;
+    }
+}
+
+// Nagle holds the tail of a message written in several sends until the previous segments are
+// acked, which can wait for a delayed ACK (40ms+). Setting TCP_NODELAY sends it right away
+static void ws_socket_push(int fd) {
+    set_int_opt(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+    set_int_opt(fd, IPPROTO_TCP, TCP_NODELAY, 0);
+}
+
+// 1 when everything was sent, 0 on timeout or error
+static int send_all(int fd, const uint8_t* buf, size_t len, int max_usecs) {
+    size_t off = 0;
+    while (off < len) {
+        int n = send_some(fd, buf + off, len - off, max_usecs);
+        if (n <= 0) return 0;
         off += (size_t)n;
     }
-    return off;
+    return 1;
 }
 
 static void maybe_compact(WsConn* c) {
@@ -215,6 +640,11 @@ static int ensure_capacity(WsConn* c, size_t extra) {
 }
 
 static uint16_t read_be16(const uint8_t* p) { return (uint16_t)(p[0] << 8) | p[1]; }
+static uint64_t read_be64(const uint8_t* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v = (v << 8) | p[i];
+    return v;
+}
 
 // ===================== Handshake =====================
 
@@ -292,7 +722,175 @@ static int ws_make_accept(const char* client_key, char* out_b64, size_t out_cap)
 }
 
 
-static int ws_do_server_handshake(int fd, int max_usecs) {
+// ===================== HTTP assets =====================
+
+typedef struct WsAsset {
+    struct WsAsset* next;
+    char*    path;
+    char*    content_type;
+    uint8_t* data;
+    size_t   len;
+    uint8_t* gz;                // NULL when gzip doesn't make it smaller
+    size_t   gz_len;
+    char     etag[32];
+    char     etag_gz[32];       // each content-coding needs its own strong validator
+    int      max_age_secs;
+} WsAsset;
+
+static void ws_asset_free(WsAsset* a) {
+    free(a->path);
+    free(a->content_type);
+    free(a->data);
+    free(a->gz);
+    free(a);
+}
+
+static char* ws_strdup(const char* s) {
+    size_t n = strlen(s) + 1;
+    char* d = (char*)malloc(n);
+    if (d) memcpy(d, s, n);
+    return d;
+}
+
+bool ws_server_add_asset(WsServer* server, const char* path, const char* content_type,
+    const void* data, size_t len, int max_age_secs) {
+    if (!server || !path || path[0] != '/' || !content_type || (!data && len)) return false;
+
+    WsAsset* a = (WsAsset*)calloc(1, sizeof(WsAsset));
+    if (!a) return false;
+    a->path = ws_strdup(path);
+    a->content_type = ws_strdup(content_type);
+    a->data = (uint8_t*)malloc(len ? len : 1);
+    if (!a->path || !a->content_type || !a->data) {
+        ws_asset_free(a);
+        return false;
+    }
+    if (len) memcpy(a->data, data, len);
+    a->len = len;
+    a->gz = gzip_compress(a->data, len, &a->gz_len);
+    a->max_age_secs = max_age_secs;
+    unsigned crc = (unsigned)crc32_update(0, a->data, len);
+    snprintf(a->etag, sizeof(a->etag), "\"%08x-%llx\"", crc, (unsigned long long)len);
+    snprintf(a->etag_gz, sizeof(a->etag_gz), "\"%08x-%llx-gz\"", crc, (unsigned long long)len);
+
+    // Replaces the asset previously registered with the same path
+    WsAsset** it = &server->assets;
+    while (*it && strcmp((*it)->path, path) != 0)
+        it = &(*it)->next;
+    if (*it) {
+        a->next = (*it)->next;
+        ws_asset_free(*it);
+    }
+    *it = a;
+    return true;
+}
+
+static int ws_send_http_status(int fd, const char* status, const char* extra_headers, int max_usecs) {
+    char resp[512];
+    size_t body_len = strlen(status);
+    int resp_len = snprintf(resp, sizeof(resp),
+        "HTTP/1.1 %s\r\n"
+        "%s"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: %d\r\n"
+        "Connection: close\r\n"
+        "\r\n"
+        "%s", status, extra_headers, (int)body_len, status);
+    if (resp_len <= 0 || resp_len >= (int)sizeof(resp)) return 0;
+    return send_all(fd, (const uint8_t*)resp, (size_t)resp_len, max_usecs);
+}
+
+// Answers a request without Sec-WebSocket-Key from the server assets. The socket is
+// closed after the response, there is no keep-alive
+static int ws_serve_http(const WsServer* server, int fd, const char* req, int max_usecs) {
+    char method[8], target[1024];
+    if (sscanf(req, "%7s %1023s", method, target) != 2) return 0;
+    bool is_head = strcmp(method, "HEAD") == 0;
+    if (!is_head && strcmp(method, "GET") != 0)
+        return ws_send_http_status(fd, "405 Method Not Allowed", "Allow: GET, HEAD\r\n", max_usecs);
+
+    char* query = strpbrk(target, "?#");
+    if (query) *query = '\0';
+
+    const WsAsset* a = server ? server->assets : NULL;
+    while (a && strcmp(a->path, target) != 0)
+        a = a->next;
+    if (!a)
+        return ws_send_http_status(fd, "404 Not Found", "", max_usecs);
+
+    const char* headers = strstr(req, "\r\n");
+    headers = headers ? headers + 2 : "";
+
+    char cache_control[64];
+    if (a->max_age_secs > 0)
+        snprintf(cache_control, sizeof(cache_control), "max-age=%d", a->max_age_secs);
+    else
+        snprintf(cache_control, sizeof(cache_control), "no-cache");     // always revalidate with the ETag
+
+    char value[256];
+    bool gzip = a->gz && header_get_value(headers, "Accept-Encoding", value, sizeof(value)) && strstr(value, "gzip");
+    const char* etag = gzip ? a->etag_gz : a->etag;
+
+    // Both codings have the same content, a cached copy of either one is still valid
+    if (header_get_value(headers, "If-None-Match", value, sizeof(value))
+        && (strstr(value, a->etag) || strstr(value, a->etag_gz) || strcmp(value, "*") == 0)) {
+        char resp[256];
+        int resp_len = snprintf(resp, sizeof(resp),
+            "HTTP/1.1 304 Not Modified\r\n"
+            "ETag: %s\r\n"
+            "Cache-Control: %s\r\n"
+            "Connection: close\r\n"
+            "\r\n", etag, cache_control);
+        if (resp_len <= 0 || resp_len >= (int)sizeof(resp)) return 0;
+        return send_all(fd, (const uint8_t*)resp, (size_t)resp_len, max_usecs);
+    }
+
+    const uint8_t* body = gzip ? a->gz : a->data;
+    size_t body_len = gzip ? a->gz_len : a->len;
+
+    char resp[1024];
+    int resp_len = snprintf(resp, sizeof(resp),
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %llu\r\n"
+        "%s"
+        "Vary: Accept-Encoding\r\n"
+        "ETag: %s\r\n"
+        "Cache-Control: %s\r\n"
+        "Connection: close\r\n"
+        "\r\n", a->content_type, (unsigned long long)body_len,
+        gzip ? "Content-Encoding: gzip\r\n" : "", etag, cache_control);
+    if (resp_len <= 0 || resp_len >= (int)sizeof(resp)) return 0;
+    if (!send_all(fd, (const uint8_t*)resp, (size_t)resp_len, max_usecs)) return 0;
+    if (is_head || !body_len) return 1;
+    return send_all(fd, body, body_len, max_usecs);
+}
+
+// req is the null-terminated request, including the empty line
+// Plain http requests are answered from the server assets, and 0 is returned as no ws was opened
+static int ws_send_handshake_response(const WsServer* server, int fd, const char* req, int max_usecs) {
+    char ws_key[256];
+    if (!header_get_value(req, "Sec-WebSocket-Key", ws_key, sizeof(ws_key))) {
+        ws_serve_http(server, fd, req, max_usecs);
+        return 0;
+    }
+
+    char accept[128];
+    if (!ws_make_accept(ws_key, accept, sizeof(accept))) return 0;
+
+    char resp[512];
+    int resp_len = snprintf(resp, sizeof(resp),
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: %s\r\n"
+        "\r\n", accept);
+    if (resp_len <= 0 || resp_len >= (int)sizeof(resp)) return 0;
+
+    return send_all(fd, (const uint8_t*)resp, (size_t)resp_len, max_usecs);
+}
+
+static int ws_do_server_handshake(const WsServer* server, int fd, int max_usecs) {
     // Read until \r\n\r\n (max 8KB)
     char req[8192];
     int used = 0;
@@ -320,22 +918,56 @@ static int ws_do_server_handshake(int fd, int max_usecs) {
         if (strstr(req, "\r\n\r\n")) break;
     }
 
-    char ws_key[256];
-    if (!header_get_value(req, "Sec-WebSocket-Key", ws_key, sizeof(ws_key))) return 0;
-
-    char accept[128];
-    if (!ws_make_accept(ws_key, accept, sizeof(accept))) return 0;
+    return ws_send_handshake_response(server, fd, req, max_usecs);
+}
 
-    char resp[512];
-    int resp_len = snprintf(resp, sizeof(resp),
-        "HTTP/1.1 101 Switching Protocols\r\n"
+// Bytes received after the response headers are returned in extra/extra_len
+static int ws_do_client_handshake(int fd, const char* host, int max_usecs, char* extra, size_t* extra_len) {
+    uint8_t nonce[16];
+    for (int i = 0; i < 16; i++) nonce[i] = (uint8_t)(rand() & 0xFF);
+    char key[32];
+    if (!base64_encode(nonce, sizeof(nonce), key, sizeof(key))) return 0;
+
+    char req[512];
+    int req_len = snprintf(req, sizeof(req),
+        "GET / HTTP/1.1\r\n"
+        "Host: %s\r\n"
         "Upgrade: websocket\r\n"
         "Connection: Upgrade\r\n"
-        "Sec-WebSocket-Accept: %s\r\n"
-        "\r\n", accept);
-    if (resp_len <= 0 || resp_len >= (int)sizeof(resp)) return 0;
+        "Sec-WebSocket-Key: %s\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "\r\n", host, key);
+    if (req_len <= 0 || req_len >= (int)sizeof(req)) return 0;
+    if (!send_all(fd, (const uint8_t*)req, (size_t)req_len, max_usecs)) return 0;
+
+    char resp[4096];
+    int used = 0;
+    const char* end = NULL;
+    while (!end) {
+        if (used >= (int)sizeof(resp) - 1) return 0;
+        if (wait_fd(fd, 1, max_usecs) <= 0) return 0;
+        int n = recv(fd, resp + used, (int)sizeof(resp) - 1 - used, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        if (n == 0) return 0;
+        used += n;
+        resp[used] = '\0';
+        end = strstr(resp, "\r\n\r\n");
+    }
+
+    if (strncmp(resp, "HTTP/1.1 101", 12) != 0) return 0;
 
-    return send_all(fd, (const uint8_t*)resp, (size_t)resp_len, max_usecs) > 0;
+    char expected[128], got[128];
+    if (!ws_make_accept(key, expected, sizeof(expected))) return 0;
+    if (!header_get_value(strstr(resp, "\r\n") + 2, "Sec-WebSocket-Accept", got, sizeof(got))) return 0;
+    if (strcmp(expected, got) != 0) return 0;
+
+    size_t hdr_len = (size_t)(end + 4 - resp);
+    *extra_len = (size_t)used - hdr_len;
+    memcpy(extra, resp + hdr_len, *extra_len);
+    return 1;
 }
 
 
@@ -357,53 +989,216 @@ static void ws_socket_shutdown_wr(int fd) {
 #endif
 }
 
+void ws_server_config_init(WsServerConfig* cfg, WsServerProfile profile) {
+    if (!cfg) return;
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->backlog = 16;
+    cfg->reuse_addr = true;
+
+    switch (profile) {
+    case WS_PROFILE_BUSY_POLL:
+        cfg->spin_usecs = 200;
+        // fallthrough
+    case WS_PROFILE_LOW_LATENCY:
+        cfg->tcp_nodelay = true;
+        cfg->tcp_quickack = true;
+        cfg->busy_poll_usecs = 50;
+        cfg->keepalive = true;
+        cfg->keepalive_idle_secs = 30;
+        cfg->keepalive_interval_secs = 5;
+        cfg->keepalive_count = 3;
+        break;
+    case WS_PROFILE_HIGH_THROUGHPUT:
+        cfg->backlog = 128;
+        cfg->sndbuf_bytes = 4 * 1024 * 1024;
+        cfg->rcvbuf_bytes = 4 * 1024 * 1024;
+        cfg->keepalive = true;
+        cfg->keepalive_idle_secs = 30;
+        cfg->keepalive_interval_secs = 5;
+        cfg->keepalive_count = 3;
+        break;
+    default:
+        break;
+    }
+}
+
 WsServer* ws_server_create(int port) {
-    int fd = (int)socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0) return NULL;
-    set_reuseaddr(fd);
+    WsServerConfig cfg;
+    ws_server_config_init(&cfg, WS_PROFILE_DEFAULT);
+    return ws_server_create_ex(port, &cfg);
+}
+
+// Checks what is at a unix socket path: 1 a socket file (id set), 0 nothing, -1 anything else
+static int ws_unix_socket_file(const char* path, uint64_t* id) {
+    *id = 0;
+#ifdef _WIN32
+    // AF_UNIX sockets are reparse points, there is no inode to compare
+    DWORD attr = GetFileAttributesA(path);
+    if (attr == INVALID_FILE_ATTRIBUTES) return GetLastError() == ERROR_FILE_NOT_FOUND ? 0 : -1;
+    return (attr & FILE_ATTRIBUTE_REPARSE_POINT) ? 1 : -1;
+#else
+    struct stat st;
+    if (lstat(path, &st) < 0) return errno == ENOENT ? 0 : -1;
+    if (!S_ISSOCK(st.st_mode)) return -1;
+    *id = (uint64_t)st.st_ino;
+    return 1;
+#endif
+}
+
+// A socket file that refuses connections is left over by a process that didn't clean up
+static int ws_unix_socket_is_live(const WsSockAddr* addr) {
+    int fd = (int)socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return 1;
+    set_nonblocking(fd, 1); // a listener with a full backlog would block the connect
+    int rc = connect(fd, (const struct sockaddr*)&addr->addr, addr->len);
+#ifdef _WIN32
+    int stale = rc < 0 && WSAGetLastError() == WSAECONNREFUSED;
+#else
+    int stale = rc < 0 && (errno == ECONNREFUSED || errno == ENOENT);
+#endif
+    ws_socket_close(&fd);
+    return !stale;
+}
 
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons((uint16_t)port);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+WsServer* ws_server_create_ex(int port, const WsServerConfig* cfg) {
+    if (!cfg) return NULL;
+
+    WsSockAddr addr;
+    int family = resolve_address(cfg->bind_address, port, &addr);
+    if (family < 0) return NULL;
+
+    // A stale socket file from a previous run makes bind fail. Only a socket nobody listens on
+    // is removed, a running server or any other kind of file at the path is an error
+    char* unix_path = NULL;
+    if (family == AF_UNIX && cfg->bind_address[5] != '@') {
+        const char* path = cfg->bind_address + 5;
+        uint64_t id;
+        int kind = ws_unix_socket_file(path, &id);
+        if (kind < 0) return NULL;
+        if (kind > 0) {
+            if (ws_unix_socket_is_live(&addr)) return NULL;
+            remove(path);
+        }
+        size_t n = strlen(path) + 1;
+        unix_path = (char*)malloc(n);
+        if (!unix_path) return NULL;
+        memcpy(unix_path, path, n);
+    }
 
-    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    int fd = (int)socket(family, SOCK_STREAM, 0);
+    if (fd < 0) { free(unix_path); return NULL; }
+    if (cfg->reuse_addr && family != AF_UNIX)
+        set_reuseaddr(fd);
+    if (family == AF_INET6)
+        set_int_opt(fd, IPPROTO_IPV6, IPV6_V6ONLY, cfg->ipv6_only ? 1 : 0);
+    apply_socket_config(fd, family, cfg);
+
+    if (bind(fd, (struct sockaddr*)&addr.addr, addr.len) < 0) {
         ws_socket_close(&fd);
+        free(unix_path);
         return NULL;
     }
-    if (listen(fd, 16) < 0) {
+    if (listen(fd, cfg->backlog > 0 ? cfg->backlog : 16) < 0) {
         ws_socket_close(&fd);
+        if (unix_path) remove(unix_path);
+        free(unix_path);
         return NULL;
     }
 
     WsServer* s = (WsServer*)calloc(1, sizeof(WsServer));
-    if (!s) { ws_socket_close(&fd); return NULL; }
+    if (!s) { ws_socket_close(&fd); free(unix_path); return NULL; }
     s->fd = fd;
+    s->family = family;
+    s->config = *cfg;
+    s->config.bind_address = NULL;
+    s->unix_path = unix_path;
+    if (unix_path)
+        ws_unix_socket_file(unix_path, &s->unix_file_id);
     return s;
 }
 
-// returns NULL on timeout or error
-WsConn* ws_server_accept(WsServer* server, int max_usecs) {
-    if (!server) return NULL;
+// ===================== Socket transport =====================
 
-    int w = wait_fd(server->fd, 1, max_usecs);
-    if (w <= 0) return NULL;
+// Returns the bytes read, 0 when there is nothing to read, < 0 on error or when the peer closed
+static int recv_nowait(int fd, uint8_t* buf, size_t cap) {
+#ifdef MSG_DONTWAIT
+    int n = (int)recv(fd, (char*)buf, (int)MIN(cap, (size_t)INT_MAX), MSG_DONTWAIT);
+    if (n < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+#else
+    int rdy = wait_fd(fd, 1, 0);
+    if (rdy <= 0)
+        return rdy;
+    int n = recv(fd, (char*)buf, (int)MIN(cap, (size_t)INT_MAX), 0);
+    if (n < 0)
+        return -1;
+#endif
+    return n == 0 ? -1 : n;
+}
 
-    struct sockaddr_in cli;
-    socklen_t clen = sizeof(cli);
-    int cfd = (int)accept(server->fd, (struct sockaddr*)&cli, &clen);
-    if (cfd < 0) return NULL;
+static int ws_socket_read(WsConn* c, uint8_t* buf, size_t cap, int max_usecs) {
+    int n = 0;
+
+    // Spin mode: the thread keeps polling the socket instead of sleeping in poll, which
+    // saves the wake up latency. Single checks (max_usecs 0) don't spin
+    if (c->spin_usecs > 0 && max_usecs != 0) {
+        uint64_t spin = (uint64_t)((max_usecs > 0 && max_usecs < c->spin_usecs) ? max_usecs : c->spin_usecs);
+        uint64_t t0 = ws_now_usecs();
+        uint64_t elapsed = 0;
+        do {
+            n = recv_nowait(c->fd, buf, cap);
+            if (n != 0) break;
+            elapsed = ws_now_usecs() - t0;
+        } while (elapsed < spin);
+        if (n < 0)
+            return -1;
+        if (n == 0 && max_usecs > 0)
+            max_usecs = (elapsed >= (uint64_t)max_usecs) ? 0 : max_usecs - (int)elapsed;
+    }
 
-    if (!ws_do_server_handshake(cfd, max_usecs)) {
-        ws_socket_close(&cfd);
-        return NULL;
+    if (n == 0) {
+        int rdy = wait_fd(c->fd, 1, max_usecs);
+        if (rdy <= 0)
+            return rdy;
+
+        n = recv(c->fd, (char*)buf, (int)MIN(cap, (size_t)INT_MAX), 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                return 0;
+            return -1;
+        }
+        if (n == 0)
+            return -1;
     }
 
+    if (c->quickack)
+        set_quickack(c->fd);
+    return n;
+}
+
+static int ws_socket_write(WsConn* c, const uint8_t* buf, size_t len, int max_usecs) {
+    return send_some(c->fd, buf, len, max_usecs);
+}
+
+static void ws_socket_transport_close(WsConn* c) {
+    ws_socket_shutdown_wr(c->fd);
+    ws_socket_close(&c->fd);
+}
+
+static const WsTransport ws_socket_transport = {
+    ws_socket_read,
+    ws_socket_write,
+    ws_socket_transport_close,
+};
+
+WsConn* ws_conn_create_transport(const WsTransport* transport, void* ctx, bool is_client) {
+    if (!transport) return NULL;
     WsConn* c = (WsConn*)calloc(1, sizeof(WsConn));
-    if (!c) { ws_socket_close(&cfd); return NULL; }
-    c->fd = cfd;
-    c->is_client = false;
+    if (!c) return NULL;
+    c->fd = -1;
+    c->transport = transport;
+    c->transport_ctx = ctx;
+    c->is_client = is_client;
     c->is_connected = true;
     c->read_buffer = NULL;
     c->read_buffer_size = 0;
@@ -412,24 +1207,417 @@ WsConn* ws_server_accept(WsServer* server, int max_usecs) {
     c->close_sent = false;
     c->close_received = false;
     c->skip_timeout_reading_network = false;
+    c->handshake_pending = false;
+    c->quickack = false;
+    c->nagle = false;
+    c->spin_usecs = 0;
     return c;
 }
 
-void ws_server_destroy(WsServer* server) {
-    if (!server) return;
-    if (server->fd >= 0) ws_socket_close(&server->fd);
-    free(server);
+// cfg is optional, the per connection options are copied from it
+static WsConn* ws_conn_create(int fd, bool is_client, int family, const WsServerConfig* cfg) {
+    WsConn* c = ws_conn_create_transport(&ws_socket_transport, NULL, is_client);
+    if (!c) return NULL;
+    set_nosigpipe(fd);
+    c->fd = fd;
+    c->quickack = cfg && cfg->tcp_quickack && family != AF_UNIX;
+    c->nagle = family != AF_UNIX && !(cfg && cfg->tcp_nodelay);
+    c->spin_usecs = cfg && cfg->spin_usecs > 0 ? cfg->spin_usecs : 0;
+    return c;
 }
 
+// returns NULL on timeout or error
+WsConn* ws_server_accept(WsServer* server, int max_usecs) {
+    if (!server) return NULL;
 
-// ===================== Frame build/send =====================
+    int w = wait_fd(server->fd, 1, max_usecs);
+    if (w <= 0) return NULL;
 
-static size_t ws_build_header(uint8_t* dst, size_t cap, uint8_t opcode, uint64_t len,
-    int mask, uint8_t mask_key[4]) {
+    struct sockaddr_storage cli;
+    socklen_t clen = sizeof(cli);
+    int cfd = (int)accept(server->fd, (struct sockaddr*)&cli, &clen);
+    if (cfd < 0) return NULL;
+
+    // Not every option is inherited from the listener (NODELAY, QUICKACK, keepalive timers)
+    apply_socket_config(cfd, server->family, &server->config);
+
+    if (!ws_do_server_handshake(server, cfd, max_usecs)) {
+        ws_socket_close(&cfd);
+        return NULL;
+    }
+
+    WsConn* c = ws_conn_create(cfd, false, server->family, &server->config);
+    if (!c) { ws_socket_close(&cfd); return NULL; }
+    if (server->recorder)
+        ws_conn_set_recorder(c, server->recorder);
+    return c;
+}
+
+// The handshake is completed by ws_conn_poll_event, so a slow client does not block the caller
+WsConn* ws_server_accept_pending(WsServer* server) {
+    if (!server) return NULL;
+
+    if (wait_fd(server->fd, 1, 0) <= 0) return NULL;
+
+    struct sockaddr_storage cli;
+    socklen_t clen = sizeof(cli);
+    int cfd = (int)accept(server->fd, (struct sockaddr*)&cli, &clen);
+    if (cfd < 0) return NULL;
+
+    apply_socket_config(cfd, server->family, &server->config);
+
+    WsConn* c = ws_conn_create(cfd, false, server->family, &server->config);
+    if (!c) { ws_socket_close(&cfd); return NULL; }
+    c->is_connected = false;
+    c->handshake_pending = true;
+    c->server = server;
+    if (server->recorder)
+        ws_conn_set_recorder(c, server->recorder);
+    return c;
+}
+
+void ws_server_destroy(WsServer* server) {
+    if (!server) return;
+    if (server->fd >= 0) ws_socket_close(&server->fd);
+    // The path may have been taken by something else since, only the socket file bound here is removed
+    uint64_t id;
+    if (server->unix_path && ws_unix_socket_file(server->unix_path, &id) > 0 && id == server->unix_file_id)
+        remove(server->unix_path);
+    free(server->unix_path);
+    while (server->assets) {
+        WsAsset* next = server->assets->next;
+        ws_asset_free(server->assets);
+        server->assets = next;
+    }
+    free(server);
+}
+
+// ===================== Client API =====================
+
+static int ws_socket_connect(int fd, const WsSockAddr* addr, int max_usecs) {
+    if (set_nonblocking(fd, 1) < 0) return 0;
+    int rc = connect(fd, (const struct sockaddr*)&addr->addr, addr->len);
+    if (rc < 0) {
+#ifdef _WIN32
+        if (WSAGetLastError() != WSAEWOULDBLOCK) return 0;
+#else
+        if (errno != EINPROGRESS) return 0;
+#endif
+        if (wait_fd(fd, 0, max_usecs) <= 0) return 0;
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (char*)&err, &len) < 0 || err != 0) return 0;
+    }
+    return set_nonblocking(fd, 0) == 0;
+}
+
+WsConn* ws_client_connect(const char* address, int port, const WsServerConfig* cfg, int max_usecs) {
+    if (!address || !address[0]) return NULL;
+
+    WsSockAddr addr;
+    int family = resolve_address(address, port, &addr);
+    if (family < 0) return NULL;
+
+    int fd = (int)socket(family, SOCK_STREAM, 0);
+    if (fd < 0) return NULL;
+    if (cfg)
+        apply_socket_config(fd, family, cfg);
+
+    if (!ws_socket_connect(fd, &addr, max_usecs)) {
+        ws_socket_close(&fd);
+        return NULL;
+    }
+
+    char host[300];
+    if (family == AF_UNIX)
+        snprintf(host, sizeof(host), "localhost");
+    else if (family == AF_INET6 && strchr(address, ':'))
+        snprintf(host, sizeof(host), "[%s]:%d", address, port);
+    else
+        snprintf(host, sizeof(host), "%s:%d", address, port);
+
+    char extra[4096];
+    size_t extra_len = 0;
+    if (!ws_do_client_handshake(fd, host, max_usecs, extra, &extra_len)) {
+        ws_socket_close(&fd);
+        return NULL;
+    }
+
+    WsConn* c = ws_conn_create(fd, true, family, cfg);
+    if (!c) { ws_socket_close(&fd); return NULL; }
+    if (extra_len) {
+        if (!ensure_capacity(c, extra_len)) { ws_conn_destroy(c); return NULL; }
+        memcpy(c->read_buffer, extra, extra_len);
+        c->read_buffer_size = extra_len;
+    }
+    return c;
+}
+
+
+// ===================== Memory transport =====================
+
+// Growable ring, head/tail are free running counters
+typedef struct {
+    uint8_t* data;
+    size_t   capacity;      // power of two
+    size_t   head;          // next byte to read
+    size_t   tail;          // next byte to write
+} WsRing;
+
+static int ws_ring_reserve(WsRing* r, size_t n) {
+    size_t used = r->tail - r->head;
+    if (used + n <= r->capacity) return 1;
+
+    size_t newcap = r->capacity ? r->capacity : 4096;
+    while (newcap < used + n) newcap *= 2;
+    uint8_t* nd = (uint8_t*)malloc(newcap);
+    if (!nd) return 0;
+    // Linearize the pending bytes at the start of the new buffer
+    size_t pos = r->head & (r->capacity - 1);
+    size_t first = r->capacity ? MIN(used, r->capacity - pos) : 0;
+    if (first) memcpy(nd, r->data + pos, first);
+    if (used > first) memcpy(nd + first, r->data, used - first);
+    free(r->data);
+    r->data = nd;
+    r->capacity = newcap;
+    r->head = 0;
+    r->tail = used;
+    return 1;
+}
+
+static size_t ws_ring_write(WsRing* r, const uint8_t* src, size_t n) {
+    if (!ws_ring_reserve(r, n)) return 0;
+    size_t pos = r->tail & (r->capacity - 1);
+    size_t first = MIN(n, r->capacity - pos);
+    memcpy(r->data + pos, src, first);
+    memcpy(r->data, src + first, n - first);
+    r->tail += n;
+    return n;
+}
+
+static size_t ws_ring_read(WsRing* r, uint8_t* dst, size_t cap) {
+    size_t n = MIN(cap, r->tail - r->head);
+    if (!n) return 0;
+    size_t pos = r->head & (r->capacity - 1);
+    size_t first = MIN(n, r->capacity - pos);
+    memcpy(dst, r->data + pos, first);
+    memcpy(dst + first, r->data, n - first);
+    r->head += n;
+    return n;
+}
+
+typedef struct {
+    WsRing rings[2];        // [0] client to server, [1] server to client
+    int    refs;
+    bool   closed;
+} WsMemPipe;
+
+typedef struct {
+    WsMemPipe* pipe;
+    int        side;        // 0 client, 1 server
+} WsMemEnd;
+
+// Never waits: the peer runs in the same thread, so nothing can arrive while waiting
+static int ws_mem_read(WsConn* c, uint8_t* buf, size_t cap, int max_usecs) {
+    (void)max_usecs;
+    WsMemEnd* end = (WsMemEnd*)c->transport_ctx;
+    size_t n = ws_ring_read(&end->pipe->rings[1 - end->side], buf, MIN(cap, (size_t)INT_MAX));
+    if (n) return (int)n;
+    return end->pipe->closed ? -1 : 0;
+}
+
+static int ws_mem_write(WsConn* c, const uint8_t* buf, size_t len, int max_usecs) {
+    (void)max_usecs;
+    WsMemEnd* end = (WsMemEnd*)c->transport_ctx;
+    if (end->pipe->closed) return -1;
+    size_t n = ws_ring_write(&end->pipe->rings[end->side], buf, MIN(len, (size_t)INT_MAX));
+    return n ? (int)n : -1;
+}
+
+static void ws_mem_close(WsConn* c) {
+    WsMemEnd* end = (WsMemEnd*)c->transport_ctx;
+    WsMemPipe* pipe = end->pipe;
+    pipe->closed = true;
+    if (--pipe->refs == 0) {
+        free(pipe->rings[0].data);
+        free(pipe->rings[1].data);
+        free(pipe);
+    }
+    free(end);
+    c->transport_ctx = NULL;
+}
+
+static const WsTransport ws_mem_transport = {
+    ws_mem_read,
+    ws_mem_write,
+    ws_mem_close,
+};
+
+bool ws_mem_pair_create(WsConn** client, WsConn** server) {
+    if (!client || !server) return false;
+    *client = NULL;
+    *server = NULL;
+
+    WsMemPipe* pipe = (WsMemPipe*)calloc(1, sizeof(WsMemPipe));
+    WsMemEnd* ends[2] = { (WsMemEnd*)calloc(1, sizeof(WsMemEnd)), (WsMemEnd*)calloc(1, sizeof(WsMemEnd)) };
+    if (!pipe || !ends[0] || !ends[1]) {
+        free(pipe);
+        free(ends[0]);
+        free(ends[1]);
+        return false;
+    }
+    pipe->refs = 2;
+    for (int i = 0; i < 2; i++) {
+        ends[i]->pipe = pipe;
+        ends[i]->side = i;
+    }
+
+    WsConn* c = ws_conn_create_transport(&ws_mem_transport, ends[0], true);
+    WsConn* srv = ws_conn_create_transport(&ws_mem_transport, ends[1], false);
+    if (!c || !srv) {
+        // Nothing has been written yet, the conns don't own anything else
+        free(c);
+        free(srv);
+        free(ends[0]);
+        free(ends[1]);
+        free(pipe);
+        return false;
+    }
+    *client = c;
+    *server = srv;
+    return true;
+}
+
+// ===================== Recorder =====================
+
+struct WsRecorder {
+    uint64_t start_usecs;
+    uint32_t next_conn_id;
+    bool     failed;        // io error, stop recording but keep serving
+#ifdef _WIN32
+    FILE*    f;
+#else
+    int      fd;
+    uint8_t* map;           // current segment
+    size_t   map_offset;    // file offset of the segment, page aligned
+    size_t   map_size;
+    size_t   used;          // bytes written to the file
+#endif
+};
+
+#ifndef _WIN32
+// Maps a segment covering [used, used + n). The file grows one segment at a time
+static int ws_recorder_reserve(WsRecorder* r, size_t n) {
+    if (r->map && r->used + n <= r->map_offset + r->map_size) return 1;
+    if (r->map) {
+        munmap(r->map, r->map_size);
+        r->map = NULL;
+    }
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t offset = r->used & ~(page - 1);
+    size_t size = WS_RECORD_SEGMENT;
+    while (offset + size < r->used + n) size *= 2;
+    if (ftruncate(r->fd, (off_t)(offset + size)) < 0) return 0;
+    void* m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, (off_t)offset);
+    if (m == MAP_FAILED) return 0;
+    r->map = (uint8_t*)m;
+    r->map_offset = offset;
+    r->map_size = size;
+    return 1;
+}
+#endif
+
+static void ws_recorder_write(WsRecorder* r, const void* data, size_t len) {
+#ifdef _WIN32
+    if (fwrite(data, 1, len, r->f) != len) r->failed = true;
+#else
+    memcpy(r->map + (r->used - r->map_offset), data, len);
+    r->used += len;
+#endif
+}
+
+static void ws_record(WsConn* c, WsRecordKind kind, uint8_t opcode, const void* payload, size_t len) {
+    WsRecorder* r = c->recorder;
+    if (!r || r->failed) return;
+    if (len > 0xFFFFFFFFu) return;
+
+    uint8_t hdr[WS_RECORD_HEADER_SIZE];
+    write_le64(hdr, ws_now_usecs() - r->start_usecs);
+    write_le32(hdr + 8, c->record_id);
+    write_le32(hdr + 12, (uint32_t)len);
+    hdr[16] = (uint8_t)kind;
+    hdr[17] = opcode;
+
+#ifndef _WIN32
+    if (!ws_recorder_reserve(r, sizeof(hdr) + len)) {
+        r->failed = true;
+        return;
+    }
+#endif
+    ws_recorder_write(r, hdr, sizeof(hdr));
+    if (len) ws_recorder_write(r, payload, len);
+}
+
+WsRecorder* ws_recorder_create(const char* filename) {
+    if (!filename) return NULL;
+    WsRecorder* r = (WsRecorder*)calloc(1, sizeof(WsRecorder));
+    if (!r) return NULL;
+    r->start_usecs = ws_now_usecs();
+    r->next_conn_id = 1;
+
+#ifdef _WIN32
+    r->f = fopen(filename, "wb");
+    if (!r->f) { free(r); return NULL; }
+    setvbuf(r->f, NULL, _IOFBF, 1 << 20);
+#else
+    r->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (r->fd < 0) { free(r); return NULL; }
+    if (!ws_recorder_reserve(r, 8)) {
+        close(r->fd);
+        free(r);
+        return NULL;
+    }
+#endif
+    ws_recorder_write(r, WS_RECORD_MAGIC, 8);
+    return r;
+}
+
+void ws_recorder_destroy(WsRecorder* r) {
+    if (!r) return;
+#ifdef _WIN32
+    fclose(r->f);
+#else
+    if (r->map) munmap(r->map, r->map_size);
+    // Remove the unused tail of the last segment. If it fails the zeroed tail still ends the log
+    if (ftruncate(r->fd, (off_t)r->used) < 0)
+        r->failed = true;
+    close(r->fd);
+#endif
+    free(r);
+}
+
+void ws_conn_set_recorder(WsConn* conn, WsRecorder* recorder) {
+    if (!conn) return;
+    if (conn->recorder)
+        ws_record(conn, WS_REC_CLOSE, 0, NULL, 0);
+    conn->recorder = recorder;
+    if (!recorder) return;
+    conn->record_id = recorder->next_conn_id++;
+    ws_record(conn, WS_REC_OPEN, 0, NULL, 0);
+}
+
+void ws_server_set_recorder(WsServer* server, WsRecorder* recorder) {
+    if (server) server->recorder = recorder;
+}
+
+// ===================== Frame build/send =====================
+
+static size_t ws_build_header(uint8_t* dst, size_t cap, int fin, uint8_t opcode, uint64_t len,
+    int mask, uint8_t mask_key[4]) {
     if (cap < 2) return 0;
     size_t h = 0;
 
-    dst[h++] = (uint8_t)(0x80 | (opcode & 0x0F)); // FIN=1
+    dst[h++] = (uint8_t)((fin ? 0x80 : 0x00) | (opcode & 0x0F));
 
     if (len <= 125) {
         dst[h++] = (uint8_t)((mask ? 0x80 : 0x00) | (uint8_t)len);
@@ -463,53 +1651,275 @@ static size_t ws_build_header(uint8_t* dst, size_t cap, uint8_t opcode, uint64_t
     return h;
 }
 
-static int ws_send_frame(WsConn* c, uint8_t opcode, const void* payload, size_t len) {
-    if (!c || c->fd < 0) return 0;
+// 1 when everything was written
+static int ws_conn_write_all(WsConn* c, const uint8_t* buf, size_t len, int max_usecs) {
+    size_t off = 0;
+    while (off < len) {
+        int n = c->transport->write(c, buf + off, len - off, max_usecs);
+        if (n <= 0) return 0;
+        off += (size_t)n;
+    }
+    return 1;
+}
+
+// Header and payload in one send. On sockets they are gathered, other transports get two writes
+static int ws_conn_write_all2(WsConn* c, const uint8_t* a, size_t alen, const uint8_t* b, size_t blen, int max_usecs) {
+    if (c->transport != &ws_socket_transport)
+        return ws_conn_write_all(c, a, alen, max_usecs) && ws_conn_write_all(c, b, blen, max_usecs);
+    while (alen + blen > 0) {
+        int n = send_some2(c->fd, a, alen, b, blen, max_usecs);
+        if (n <= 0) return 0;
+        size_t k = (size_t)n;
+        if (k < alen) {
+            a += k;
+            alen -= k;
+            continue;
+        }
+        k -= alen;
+        alen = 0;
+        b += k;
+        blen -= k;
+    }
+    return 1;
+}
+
+#define WS_MASK_CHUNK (64u * 1024u)     // masked payloads are copied in chunks of this size
+
+static int ws_write_frame(WsConn* c, int fin, uint8_t opcode, const void* payload, size_t len) {
+    if (!c || !c->transport) return 0;
     if (!c->is_connected) return 0;
     if (len > WS_MAX_SEND_FRAME) return 0;
 
     int mask = c->is_client ? 1 : 0;
-    uint8_t header[14];
     uint8_t mask_key[4] = { 0 };
 
-    size_t hlen = ws_build_header(header, sizeof(header), opcode, len, mask, mask_key);
+    // The header goes in the same send as the payload. A small write just for the header
+    // makes the payload wait for an ACK when Nagle is enabled
+    uint8_t tmp[4096];
+    size_t hlen = ws_build_header(tmp, 14, fin, opcode, len, mask, mask_key);
     if (!hlen) return 0;
 
-    // If masking, we must send masked payload. Avoid huge alloc: chunk it.
-    if (send_all(c->fd, header, hlen, 1000000) < 0) return 0;
-
-    if (!len) return 1;
-
-    if (!mask) {
-        return send_all(c->fd, payload, len, 1000000) == len;
+    const uint8_t* src = (const uint8_t*)payload;
+    int sends = 1;
+    if (!mask && len > sizeof(tmp) - hlen) {
+        if (!ws_conn_write_all2(c, tmp, hlen, src, len, 1000000)) return 0;
     }
     else {
-        // chunk-mask on the fly
-        uint8_t tmp[4096];
+        // The masked copy is made in chunks, as large as possible to keep the sends few
+        uint8_t* buf = tmp;
+        size_t cap = sizeof(tmp);
+        if (hlen + len > sizeof(tmp)) {
+            size_t want = MIN(hlen + len, (size_t)WS_MASK_CHUNK);
+            uint8_t* heap = (uint8_t*)malloc(want);
+            if (heap) {
+                memcpy(heap, tmp, hlen);
+                buf = heap;
+                cap = want;
+            }
+        }
+
+        size_t used = hlen;
         size_t off = 0;
-        while (off < len) {
-            size_t n = MIN(sizeof(tmp), len - off);
-            memcpy(tmp, (uint8_t*)payload + off, n);
-            for (size_t i = 0; i < n; i++) tmp[i] ^= mask_key[(off + i) & 3];
-            if (send_all(c->fd, tmp, n, 1000000) < 0) return 0;
+        int ok = 1;
+        sends = 0;
+        do {
+            size_t n = MIN(cap - used, len - off);
+            if (n) memcpy(buf + used, src + off, n);
+            if (mask) {
+                for (size_t i = 0; i < n; i++) buf[used + i] ^= mask_key[(off + i) & 3];
+            }
+            ok = ws_conn_write_all(c, buf, used + n, 1000000);
+            sends++;
             off += n;
+            used = 0;
+        } while (ok && off < len);
+        if (buf != tmp) free(buf);
+        if (!ok) return 0;
+    }
+
+    // The end of a message that took several sends, a fragmented one or a large masked frame
+    if (fin && c->nagle && (sends > 1 || opcode == 0x0))
+        ws_socket_push(c->fd);
+    return 1;
+}
+
+// The recording gets whole messages, fragmented ones are recorded once their last fragment is sent
+static int ws_send_frame(WsConn* c, uint8_t opcode, const void* payload, size_t len) {
+    int ok = ws_write_frame(c, 1, opcode, payload, len);
+    if (ok && c->recorder)
+        ws_record(c, WS_REC_OUT, opcode, payload, len);
+    return ok;
+}
+
+// ===================== Outbound queue =====================
+
+typedef struct WsOutMsg {
+    struct WsOutMsg* next;
+    uint8_t*         data;          // Right after the struct
+    size_t           len;
+    size_t           offset;        // Bytes already sent
+    uint8_t          opcode;
+} WsOutMsg;
+
+static int ws_queue_push(WsConn* c, uint8_t opcode, const void* payload, size_t len, WsPriority priority) {
+    if ((int)priority < 0 || priority >= WS_PRIORITY_COUNT) return 0;
+    if (len > WS_MAX_SEND_FRAME) return 0;
+    WsOutMsg* m = (WsOutMsg*)malloc(sizeof(WsOutMsg) + len);
+    if (!m) return 0;
+    m->next = NULL;
+    m->data = (uint8_t*)(m + 1);
+    m->len = len;
+    m->offset = 0;
+    m->opcode = opcode;
+    if (len) memcpy(m->data, payload, len);
+
+    if (c->send_queue_tail[priority]) c->send_queue_tail[priority]->next = m;
+    else c->send_queue_head[priority] = m;
+    c->send_queue_tail[priority] = m;
+    c->send_queued_bytes += len;
+    return 1;
+}
+
+static WsOutMsg* ws_queue_pop(WsConn* c) {
+    for (int p = 0; p < WS_PRIORITY_COUNT; ++p) {
+        WsOutMsg* m = c->send_queue_head[p];
+        if (!m) continue;
+        c->send_queue_head[p] = m->next;
+        if (!m->next) c->send_queue_tail[p] = NULL;
+        m->next = NULL;
+        return m;
+    }
+    return NULL;
+}
+
+static int ws_queue_empty(const WsConn* c) {
+    if (c->send_current) return 0;
+    for (int p = 0; p < WS_PRIORITY_COUNT; ++p)
+        if (c->send_queue_head[p]) return 0;
+    return 1;
+}
+
+static void ws_queue_free(WsConn* c) {
+    WsOutMsg* m;
+    free(c->send_current);
+    c->send_current = NULL;
+    while ((m = ws_queue_pop(c)) != NULL)
+        free(m);
+    c->send_queued_bytes = 0;
+}
+
+// Data frames can't be sent while a streamed message is in progress. During a queued
+// message they go to the high priority queue, and they keep going there until it's empty,
+// so they can't overtake the ones diverted before
+static int ws_send_data_frame(WsConn* c, uint8_t opcode, const void* payload, size_t len) {
+    if (!c || c->send_stream_opcode) return 0;
+    if (c->send_current || c->send_queue_head[WS_PRIORITY_HIGH])
+        return ws_queue_push(c, opcode, payload, len, WS_PRIORITY_HIGH);
+    return ws_send_frame(c, opcode, payload, len);
+}
+
+bool ws_conn_queue_binary(WsConn* conn, const void* data, size_t len, WsPriority priority) {
+    if (!conn || !conn->is_connected) return false;
+    return ws_queue_push(conn, 0x2, data, len, priority) != 0;
+}
+
+bool ws_conn_queue_text(WsConn* conn, const char* data, size_t len, WsPriority priority) {
+    if (!conn || !conn->is_connected) return false;
+    if (len == 0)
+        len = strlen(data);
+    return ws_queue_push(conn, 0x1, data, len, priority) != 0;
+}
+
+int ws_conn_flush(WsConn* conn, int max_usecs) {
+    if (!conn || !conn->is_connected) return -1;
+    uint64_t deadline = ws_now_usecs() + (max_usecs > 0 ? (uint64_t)max_usecs : 0);
+    size_t fragment_size = conn->send_fragment_size ? conn->send_fragment_size : WS_DEFAULT_FRAGMENT_SIZE;
+
+    while (true) {
+        if (!conn->send_current) {
+            if (conn->send_stream_opcode) return 0;     // wait for ws_conn_send_end
+            conn->send_current = ws_queue_pop(conn);
+            if (!conn->send_current) return 1;
+        }
+
+        WsOutMsg* m = conn->send_current;
+        size_t n = MIN(fragment_size, m->len - m->offset);
+        int fin = (m->offset + n == m->len);
+        uint8_t opcode = m->offset ? 0x0 : m->opcode;
+        if (!ws_write_frame(conn, fin, opcode, m->data + m->offset, n)) return -1;
+        m->offset += n;
+        conn->send_queued_bytes -= n;
+        if (fin) {
+            if (conn->recorder)
+                ws_record(conn, WS_REC_OUT, m->opcode, m->data, m->len);
+            free(m);
+            conn->send_current = NULL;
         }
-        return 1;
+
+        if (ws_now_usecs() >= deadline)
+            return ws_queue_empty(conn);
     }
 }
 
 bool ws_conn_send_binary(WsConn* conn, const void* data, size_t len) {
-    return ws_send_frame(conn, 0x2, data, len) != 0;
+    return ws_send_data_frame(conn, 0x2, data, len) != 0;
 }
 
 bool ws_conn_send_text(WsConn* conn, const char* data, size_t len) {
     if( len == 0 )
 		len = strlen(data);
-    return ws_send_frame(conn, 0x1, (const uint8_t*)data, len) != 0;
+    return ws_send_data_frame(conn, 0x1, (const uint8_t*)data, len) != 0;
+}
+
+bool ws_conn_send_begin(WsConn* conn, bool is_text) {
+    if (!conn || !conn->is_connected || conn->send_stream_opcode || conn->send_current) return false;
+    conn->send_stream_opcode = is_text ? 0x1 : 0x2;
+    conn->send_stream_started = false;
+    return true;
+}
+
+// Chunks are only kept while recording, to log the message whole when it ends
+static int ws_stream_record_append(WsConn* c, const void* data, size_t len) {
+    size_t need = c->send_stream_record_size + len;
+    if (need > c->send_stream_record_capacity) {
+        size_t newcap = c->send_stream_record_capacity ? c->send_stream_record_capacity : 4096;
+        while (newcap < need) newcap *= 2;
+        uint8_t* nb = (uint8_t*)realloc(c->send_stream_record, newcap);
+        if (!nb) return 0;
+        c->send_stream_record = nb;
+        c->send_stream_record_capacity = newcap;
+    }
+    memcpy(c->send_stream_record + c->send_stream_record_size, data, len);
+    c->send_stream_record_size = need;
+    return 1;
+}
+
+// The first fragment carries the opcode, the next ones are continuations
+bool ws_conn_send_chunk(WsConn* conn, const void* data, size_t len) {
+    if (!conn || !conn->send_stream_opcode) return false;
+    if (len == 0) return true;
+    if (conn->recorder && !ws_stream_record_append(conn, data, len)) return false;
+    uint8_t opcode = conn->send_stream_started ? 0x0 : conn->send_stream_opcode;
+    if (!ws_write_frame(conn, 0, opcode, data, len)) return false;
+    conn->send_stream_started = true;
+    return true;
+}
+
+bool ws_conn_send_end(WsConn* conn) {
+    if (!conn || !conn->send_stream_opcode) return false;
+    uint8_t message_opcode = conn->send_stream_opcode;
+    uint8_t opcode = conn->send_stream_started ? 0x0 : message_opcode;
+    conn->send_stream_opcode = 0;
+    conn->send_stream_started = false;
+    int ok = ws_write_frame(conn, 1, opcode, NULL, 0);
+    if (ok && conn->recorder)
+        ws_record(conn, WS_REC_OUT, message_opcode, conn->send_stream_record, conn->send_stream_record_size);
+    conn->send_stream_record_size = 0;
+    return ok != 0;
 }
 
 static void ws_send_close_best_effort(WsConn* c, uint16_t code) {
-    if (!c || c->fd < 0) return;
+    if (!c || !c->transport) return;
     uint8_t payload[2];
     payload[0] = (uint8_t)((code >> 8) & 0xFF);
     payload[1] = (uint8_t)((code >> 0) & 0xFF);
@@ -520,20 +1930,193 @@ static void ws_send_pong_best_effort(WsConn* c, const uint8_t* p, size_t n) {
     (void)ws_send_frame(c, 0xA, p, n);
 }
 
+// ===================== Delta channel =====================
+
+typedef struct WsDeltaEntry {
+    struct WsDeltaEntry* next;
+    uint32_t key;
+    uint32_t seq;                   // of the last version sent
+    uint8_t* data;                  // last version sent, the peer has it
+    size_t   len;
+    int      deltas;                // sent since the last keyframe
+    bool     force_keyframe;
+} WsDeltaEntry;
+
+typedef struct WsDeltaState {
+    WsDeltaEntry* entries;
+    uint8_t*      scratch;          // message being built
+    size_t        scratch_cap;
+} WsDeltaState;
+
+static void ws_delta_free(WsConn* c) {
+    WsDeltaState* st = c->delta;
+    if (!st) return;
+    while (st->entries) {
+        WsDeltaEntry* next = st->entries->next;
+        free(st->entries->data);
+        free(st->entries);
+        st->entries = next;
+    }
+    free(st->scratch);
+    free(st);
+    c->delta = NULL;
+}
+
+static WsDeltaEntry* ws_delta_entry(WsConn* c, uint32_t key, bool create) {
+    if (!c->delta) {
+        if (!create) return NULL;
+        c->delta = (WsDeltaState*)calloc(1, sizeof(WsDeltaState));
+        if (!c->delta) return NULL;
+    }
+    WsDeltaEntry* e = c->delta->entries;
+    while (e && e->key != key)
+        e = e->next;
+    if (!e && create) {
+        e = (WsDeltaEntry*)calloc(1, sizeof(WsDeltaEntry));
+        if (!e) return NULL;
+        e->key = key;
+        e->force_keyframe = true;
+        e->next = c->delta->entries;
+        c->delta->entries = e;
+    }
+    return e;
+}
+
+static size_t ws_put_varint(uint8_t* dst, size_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        dst[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    dst[n++] = (uint8_t)v;
+    return n;
+}
+
+// Bytes equal in a and b from pos, 8 at a time while possible
+static size_t ws_equal_run(const uint8_t* a, const uint8_t* b, size_t pos, size_t n) {
+    size_t i = pos;
+    while (i + 8 <= n) {
+        uint64_t x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if (x != y) break;
+        i += 8;
+    }
+    while (i < n && a[i] == b[i]) i++;
+    return i - pos;
+}
+
+// Changed runs are extended over equal gaps shorter than this, a new pair would cost more
+#define WS_DELTA_MIN_GAP 8
+
+// Encodes cur against prev (same length) as (unchanged, changed) varint pairs followed by the
+// changed bytes. Returns the size, or SIZE_MAX if it doesn't fit in cap
+static size_t ws_delta_encode(const uint8_t* prev, const uint8_t* cur, size_t n, uint8_t* dst, size_t cap) {
+    size_t pos = 0, o = 0;
+    while (pos < n) {
+        size_t same = ws_equal_run(prev, cur, pos, n);
+        if (pos + same == n) break;             // the rest is unchanged
+        size_t start = pos + same;
+        size_t end = start + 1;
+        while (end < n) {
+            if (prev[end] != cur[end]) { end++; continue; }
+            size_t gap = ws_equal_run(prev, cur, end, MIN(n, end + WS_DELTA_MIN_GAP));
+            if (gap >= WS_DELTA_MIN_GAP || end + gap == n) break;
+            end += gap;
+        }
+        size_t changed = end - start;
+        if (o + 20 + changed > cap) return SIZE_MAX;
+        o += ws_put_varint(dst + o, same);
+        o += ws_put_varint(dst + o, changed);
+        memcpy(dst + o, cur + start, changed);
+        o += changed;
+        pos = end;
+    }
+    return o;
+}
+
+bool ws_conn_send_delta(WsConn* conn, uint32_t key, const void* data, size_t len) {
+    if (!conn || !conn->is_connected || (!data && len) || len > WS_MAX_SEND_FRAME - WS_DELTA_HEADER_SIZE) return false;
+    WsDeltaEntry* e = ws_delta_entry(conn, key, true);
+    if (!e) return false;
+    WsDeltaState* st = conn->delta;
+
+    size_t cap = WS_DELTA_HEADER_SIZE + len;
+    if (st->scratch_cap < cap) {
+        uint8_t* ns = (uint8_t*)realloc(st->scratch, cap);
+        if (!ns) return false;
+        st->scratch = ns;
+        st->scratch_cap = cap;
+    }
+
+    const uint8_t* cur = (const uint8_t*)data;
+    int interval = conn->delta_keyframe_interval > 0 ? conn->delta_keyframe_interval : 100;
+    bool keyframe = e->force_keyframe || e->len != len || e->deltas >= interval;
+    size_t body = 0;
+    if (!keyframe) {
+        // Not smaller than the payload -> keyframe
+        body = ws_delta_encode(e->data, cur, len, st->scratch + WS_DELTA_HEADER_SIZE, len);
+        keyframe = (body == SIZE_MAX);
+    }
+    if (keyframe) {
+        if (len) memcpy(st->scratch + WS_DELTA_HEADER_SIZE, cur, len);
+        body = len;
+    }
+
+    uint8_t* h = st->scratch;
+    memcpy(h, WS_DELTA_MAGIC, 4);
+    h[4] = keyframe ? 'K' : 'D';
+    write_le32(h + 5, key);
+    write_le32(h + 9, e->seq + 1);
+    write_le32(h + 13, (uint32_t)len);
+    if (!ws_conn_send_binary(conn, st->scratch, WS_DELTA_HEADER_SIZE + body))
+        return false;
+
+    // The message may only be queued, behind a queued message in flight. Direct sends stay in order
+    // there too, so this version is still the one the peer will decode the next delta against
+    if (e->len != len) {
+        uint8_t* nd = (uint8_t*)realloc(e->data, len ? len : 1);
+        if (!nd) {
+            e->force_keyframe = true;
+            return true;
+        }
+        e->data = nd;
+        e->len = len;
+    }
+    if (len) memcpy(e->data, cur, len);
+    e->seq++;
+    e->deltas = keyframe ? 0 : e->deltas + 1;
+    e->force_keyframe = false;
+    return true;
+}
+
+void ws_conn_delta_request_keyframe(WsConn* conn, uint32_t key) {
+    if (!conn) return;
+    WsDeltaEntry* e = ws_delta_entry(conn, key, false);
+    if (e) e->force_keyframe = true;
+}
+
 // ===================== Conn lifecycle =====================
 
 void ws_conn_destroy(WsConn* conn) {
     if (!conn) return;
 
-    if (conn->fd >= 0) {
+    if (conn->transport) {
         if (conn->is_connected && !conn->close_sent) {
             ws_send_close_best_effort(conn, 1000);
             conn->close_sent = true;
         }
-        ws_socket_shutdown_wr(conn->fd);
-        ws_socket_close(&conn->fd);
+        conn->transport->close(conn);
+        conn->transport = NULL;
     }
 
+    if (conn->recorder)
+        ws_record(conn, WS_REC_CLOSE, 0, NULL, 0);
+
+    ws_queue_free(conn);
+    ws_delta_free(conn);
+    free(conn->fragment_buffer);
+    free(conn->send_stream_record);
     free(conn->read_buffer);
     conn->read_buffer = NULL;
     conn->read_buffer_size = 0;
@@ -547,36 +2130,52 @@ void ws_conn_destroy(WsConn* conn) {
 //  0 -> no new data
 //  1 -> new data recv
 static int ws_conn_read(WsConn* conn, int max_usecs) {
-    if (!conn || conn->fd < 0) 
+    if (!conn || !conn->transport) 
         return -1;
 
     maybe_compact(conn);
-    if (!ensure_capacity(conn, 4096)) 
+    size_t buffered = conn->read_buffer_size - conn->read_offset;
+    if (buffered >= WS_MAX_READ_BUFFER)
         return -1;
-
-    int rdy = wait_fd(conn->fd, 1, max_usecs);
-    if (rdy == 0) 
-        return 0;
-    if (rdy < 0) 
+    if (!ensure_capacity(conn, 4096)) 
         return -1;
 
     // append after read_buffer_size
-    int n = recv(conn->fd,
-        conn->read_buffer + conn->read_buffer_size,
-        (int)( conn->read_buffer_capacity - conn->read_buffer_size ),
-        0);
-    if (n < 0) {
-        if (errno == EINTR) 
-            return 1;
+    size_t cap = MIN(conn->read_buffer_capacity - conn->read_buffer_size, WS_MAX_READ_BUFFER - buffered);
+    if (conn->read_limit && cap > conn->read_limit)
+        cap = conn->read_limit;
+    int n = conn->transport->read(conn, conn->read_buffer + conn->read_buffer_size, cap, max_usecs);
+    if (n < 0) 
         return -1;
-    }
     if (n == 0) 
-        return -1;
+        return 0;
 
     conn->read_buffer_size += (size_t)n;
+    conn->read_bytes += (uint64_t)n;
     return 1;
 }
 
+bool ws_conn_has_frame(const WsConn* conn) {
+    if (!conn || conn->handshake_pending || conn->read_buffer_size <= conn->read_offset) return false;
+    const uint8_t* p = conn->read_buffer + conn->read_offset;
+    size_t avail = conn->read_buffer_size - conn->read_offset;
+    if (avail < 2) return false;
+    size_t hdr = (p[1] & 0x80) ? 6 : 2;
+    uint64_t len = p[1] & 0x7F;
+    if (len == 126) {
+        if (avail < 4) return false;
+        len = read_be16(p + 2);
+        hdr += 2;
+    }
+    else if (len == 127) {
+        if (avail < 10) return false;
+        len = read_be64(p + 2);
+        hdr += 8;
+        if (len > WS_MAX_RECV_MESSAGE) return true;     // the parser reports it
+    }
+    return avail >= hdr && avail - hdr >= len;
+}
+
 void ws_conn_handle_ping_pong(WsConn* conn, const uint8_t* payload, size_t payload_len) {
     ws_send_pong_best_effort(conn, payload, payload_len);
 }
@@ -591,16 +2190,16 @@ typedef enum {
 	WS_ERROR = -1
 } WsOpcode;
 
-WsOpcode ws_conn_parse_frame(WsConn* conn, const uint8_t** payload_data, size_t* payload_len) {
-    if (payload_data) *payload_data = NULL;
-    if (payload_len)  *payload_len = 0;
-    if (!conn) return WS_ERROR;
-
+// Parses a single frame, fragments are returned as they come
+// -1 -> error
+//  0 -> no complete frame
+//  1 -> frame consumed
+static int ws_conn_parse_raw_frame(WsConn* conn, uint8_t* out_fin, uint8_t* out_opcode, uint8_t** out_payload, size_t* out_len) {
     size_t avail = (conn->read_buffer_size > conn->read_offset)
         ? (conn->read_buffer_size - conn->read_offset)
         : 0;
     if (avail < 2) 
-        return WS_NO_FRAME;
+        return 0;
 
     const uint8_t* p = conn->read_buffer + conn->read_offset;
     uint8_t b0 = p[0];
@@ -613,14 +2212,12 @@ WsOpcode ws_conn_parse_frame(WsConn* conn, const uint8_t** payload_data, size_t*
     uint8_t masked = (b1 >> 7) & 1;
     uint8_t plen7 = (b1 & 0x7F);
 
-    if (rsv != 0) return WS_ERROR;
-    if (!fin) return WS_ERROR;              // no fragmentation
-    if (opcode == 0x0) return WS_ERROR;     // no continuation
-    if (opcode == 0x3 || opcode == 0x4 || opcode == 0x5 || opcode == 0x6 || opcode == 0x7) return WS_ERROR;
-    if (opcode > 0xA) return WS_ERROR;
+    if (rsv != 0) return -1;
+    if (opcode == 0x3 || opcode == 0x4 || opcode == 0x5 || opcode == 0x6 || opcode == 0x7) return -1;
+    if (opcode > 0xA) return -1;
 
     // If we are server side, client frames MUST be masked
-    if (!conn->is_client && !masked) return WS_ERROR;
+    if (!conn->is_client && !masked) return -1;
 
     size_t hdr = 2;
     size_t payload_length = 0;
@@ -629,26 +2226,29 @@ WsOpcode ws_conn_parse_frame(WsConn* conn, const uint8_t** payload_data, size_t*
         payload_length = plen7;
     }
     else if (plen7 == 126) {
-        if (avail < hdr + 2) return WS_NO_FRAME;
+        if (avail < hdr + 2) return 0;
         payload_length = read_be16(p + hdr);
         hdr += 2;
-        if (payload_length > 65535) return WS_ERROR;
     }
     else {
-        // 127 not supported in basic mode
-        return WS_ERROR;
+        if (avail < hdr + 8) return 0;
+        uint64_t len64 = read_be64(p + hdr);
+        hdr += 8;
+        // Same bound as the reassembled messages, a single frame can't be larger
+        if (len64 > WS_MAX_RECV_MESSAGE) return -1;
+        payload_length = (size_t)len64;
     }
 
     // control frames constraints
     if (opcode >= 0x8) {
-        if (payload_length > 125) 
-            return WS_ERROR;
+        if (payload_length > 125 || !fin) 
+            return -1;
     }
 
     uint8_t mask_key[4] = { 0 };
     if (masked) {
         if (avail < hdr + 4) 
-            return WS_NO_FRAME;
+            return 0;
         mask_key[0] = p[hdr + 0];
         mask_key[1] = p[hdr + 1];
         mask_key[2] = p[hdr + 2];
@@ -656,7 +2256,7 @@ WsOpcode ws_conn_parse_frame(WsConn* conn, const uint8_t** payload_data, size_t*
         hdr += 4;
     }
 
-    if (avail < hdr + payload_length) return WS_NO_FRAME;
+    if (avail < hdr + payload_length) return 0;
 
     // Unmask in-place if needed (payload lives inside read_buffer)
     uint8_t* payload = (uint8_t*)(conn->read_buffer + conn->read_offset + hdr);
@@ -668,6 +2268,68 @@ WsOpcode ws_conn_parse_frame(WsConn* conn, const uint8_t** payload_data, size_t*
     // consume now (advance offset)
     conn->read_offset += hdr + payload_length;
 
+    *out_fin = fin;
+    *out_opcode = opcode;
+    *out_payload = payload;
+    *out_len = payload_length;
+    return 1;
+}
+
+static int ws_fragment_append(WsConn* conn, const uint8_t* data, size_t len) {
+    size_t need = conn->fragment_size + len;
+    if (need > WS_MAX_RECV_MESSAGE) return 0;
+    if (need > conn->fragment_capacity) {
+        size_t newcap = conn->fragment_capacity ? conn->fragment_capacity : 4096;
+        while (newcap < need) newcap *= 2;
+        uint8_t* nb = (uint8_t*)realloc(conn->fragment_buffer, newcap);
+        if (!nb) return 0;
+        conn->fragment_buffer = nb;
+        conn->fragment_capacity = newcap;
+    }
+    if (len) memcpy(conn->fragment_buffer + conn->fragment_size, data, len);
+    conn->fragment_size = need;
+    return 1;
+}
+
+WsOpcode ws_conn_parse_frame(WsConn* conn, const uint8_t** payload_data, size_t* payload_len) {
+    if (payload_data) *payload_data = NULL;
+    if (payload_len)  *payload_len = 0;
+    if (!conn) return WS_ERROR;
+
+    uint8_t fin = 0;
+    uint8_t opcode = 0;
+    uint8_t* payload = NULL;
+    size_t payload_length = 0;
+
+    // Fragments are reassembled in fragment_buffer, control frames can come between them
+    while (true) {
+        int rc = ws_conn_parse_raw_frame(conn, &fin, &opcode, &payload, &payload_length);
+        if (rc < 0) return WS_ERROR;
+        if (rc == 0) return WS_NO_FRAME;
+
+        if (opcode == 0x0 || (opcode <= 0x2 && !fin)) {
+            if (opcode == 0x0) {
+                if (!conn->fragment_opcode) return WS_ERROR;     // continuation without a first fragment
+            }
+            else {
+                if (conn->fragment_opcode) return WS_ERROR;      // previous message not finished
+                conn->fragment_opcode = opcode;
+                conn->fragment_size = 0;
+            }
+            if (!ws_fragment_append(conn, payload, payload_length)) return WS_ERROR;
+            if (!fin) continue;
+
+            opcode = conn->fragment_opcode;
+            conn->fragment_opcode = 0;
+            payload = conn->fragment_buffer;
+            payload_length = conn->fragment_size;
+        }
+        else if (opcode <= 0x2 && conn->fragment_opcode) {
+            return WS_ERROR;
+        }
+        break;
+    }
+
     // expose payload for ALL opcodes (makes ping/pong easy)
     if (payload_data) *payload_data = payload;
     if (payload_len)  *payload_len = payload_length;
@@ -685,6 +2347,43 @@ WsOpcode ws_conn_parse_frame(WsConn* conn, const uint8_t** payload_data, size_t*
     }
 }
 
+// Accumulates the http request in the read buffer, frames sent right after it stay buffered
+// 1 -> done
+// 0 -> needs more data
+//-1 -> failed
+static int ws_conn_handshake_step(WsConn* conn, int max_usecs) {
+    int rc = ws_conn_read(conn, max_usecs);
+    if (rc < 0)
+        return -1;
+
+    const uint8_t* p = conn->read_buffer;
+    size_t n = conn->read_buffer_size;
+    size_t hdr_len = 0;
+    for (size_t i = 3; i < n; i++) {
+        if (p[i - 3] == '\r' && p[i - 2] == '\n' && p[i - 1] == '\r' && p[i] == '\n') {
+            hdr_len = i + 1;
+            break;
+        }
+    }
+
+    char req[8192];
+    if (!hdr_len)
+        return (n >= sizeof(req) - 1) ? -1 : 0;
+    if (hdr_len >= sizeof(req))
+        return -1;
+    memcpy(req, p, hdr_len);
+    req[hdr_len] = '\0';
+
+    if (!ws_send_handshake_response(conn->server, conn->fd, req, 1000000))
+        return -1;
+
+    conn->read_offset = hdr_len;
+    conn->handshake_pending = false;
+    conn->server = NULL;
+    conn->is_connected = true;
+    return 1;
+}
+
 bool ws_conn_poll_event(WsConn** conn_ptr, WsEvent* out_evt, int max_usecs) {
     if (!conn_ptr || !*conn_ptr || !out_evt)
         return false;
@@ -694,18 +2393,38 @@ bool ws_conn_poll_event(WsConn** conn_ptr, WsEvent* out_evt, int max_usecs) {
 
     WsConn* conn = *conn_ptr;
 
+    if (conn->handshake_pending) {
+        int hs = ws_conn_handshake_step(conn, max_usecs);
+        if (hs < 0) {
+            ws_conn_destroy(conn);
+            *conn_ptr = NULL;
+            out_evt->type = WS_EVT_CLOSED;
+            return true;
+        }
+        // Frames may already be buffered, don't wait for the network in the next poll
+        conn->skip_timeout_reading_network = (hs > 0);
+        out_evt->type = WS_EVT_NONE;
+        return false;
+    }
+
     if (conn->skip_timeout_reading_network)
         max_usecs = 0;
-    
-    int rc = ws_conn_read(conn, max_usecs);
-    if (rc < 0) {
-        ws_conn_destroy(conn);
-        *conn_ptr = NULL;
-        out_evt->type = WS_EVT_CLOSED;
-        return true;
-    }
 
+    // Frames already buffered are delivered first, the socket is only read when they run out
     WsOpcode code = ws_conn_parse_frame(conn, &out_evt->payload, &out_evt->payload_len);
+    if (code == WS_NO_FRAME) {
+        int rc = ws_conn_read(conn, max_usecs);
+        if (rc < 0) {
+            ws_conn_destroy(conn);
+            *conn_ptr = NULL;
+            out_evt->type = WS_EVT_CLOSED;
+            return true;
+        }
+        if (rc > 0)
+            code = ws_conn_parse_frame(conn, &out_evt->payload, &out_evt->payload_len);
+    }
+    if (conn->recorder && code != WS_NO_FRAME && code != WS_ERROR)
+        ws_record(conn, WS_REC_IN, (uint8_t)code, out_evt->payload, out_evt->payload_len);
     if (code == WS_TEXT) {
         out_evt->type = WS_EVT_TEXT;
         conn->skip_timeout_reading_network = true;
@@ -727,11 +2446,235 @@ bool ws_conn_poll_event(WsConn** conn_ptr, WsEvent* out_evt, int max_usecs) {
         ws_conn_destroy(conn);
         *conn_ptr = NULL;
         out_evt->type = WS_EVT_CLOSED;
-        conn->skip_timeout_reading_network = false;
         return true;
     }
 
     out_evt->type = WS_EVT_NONE;
     conn->skip_timeout_reading_network = false;
     return false;
-}
\ No newline at end of file
+}
+
+
+// ===================== Poller =====================
+
+typedef struct {
+    WsConn*  conn;
+    void*    user_data;
+    bool     readable;          // the socket had data in the last wait
+    int      frames;            // delivered this tick
+    size_t   bytes;
+    // Token bucket on the bytes read from the socket, rate 0 -> not limited
+    size_t   rate;              // bytes per second
+    double   burst;
+    double   tokens;
+    uint64_t refill_usecs;
+} WsPollerEntry;
+
+struct WsPoller {
+    WsPollerEntry* entries;
+    ws_pollfd*     fds;
+    int*           fds_entry;   // entry of each pollfd
+    int            count;
+    int            capacity;
+    int            next;        // round robin cursor
+    int            max_frames;  // per connection and tick, 0 -> unlimited
+    size_t         max_bytes;
+};
+
+WsPoller* ws_poller_create(int max_frames_per_tick, size_t max_bytes_per_tick) {
+    WsPoller* p = (WsPoller*)calloc(1, sizeof(WsPoller));
+    if (!p) return NULL;
+    p->max_frames = max_frames_per_tick > 0 ? max_frames_per_tick : 0;
+    p->max_bytes = max_bytes_per_tick;
+    return p;
+}
+
+void ws_poller_destroy(WsPoller* poller) {
+    if (!poller) return;
+    free(poller->entries);
+    free(poller->fds);
+    free(poller->fds_entry);
+    free(poller);
+}
+
+static int ws_poller_find(WsPoller* p, const WsConn* conn) {
+    for (int i = 0; i < p->count; ++i)
+        if (p->entries[i].conn == conn) return i;
+    return -1;
+}
+
+bool ws_poller_add(WsPoller* poller, WsConn* conn, void* user_data) {
+    if (!poller || !conn || ws_poller_find(poller, conn) >= 0) return false;
+    if (poller->count == poller->capacity) {
+        int newcap = poller->capacity ? poller->capacity * 2 : 16;
+        WsPollerEntry* ne = (WsPollerEntry*)realloc(poller->entries, newcap * sizeof(WsPollerEntry));
+        if (!ne) return false;
+        poller->entries = ne;
+        ws_pollfd* nf = (ws_pollfd*)realloc(poller->fds, newcap * sizeof(ws_pollfd));
+        if (!nf) return false;
+        poller->fds = nf;
+        int* nfe = (int*)realloc(poller->fds_entry, newcap * sizeof(int));
+        if (!nfe) return false;
+        poller->fds_entry = nfe;
+        poller->capacity = newcap;
+    }
+    WsPollerEntry* e = &poller->entries[poller->count++];
+    memset(e, 0, sizeof(*e));
+    e->conn = conn;
+    e->user_data = user_data;
+    e->readable = true;         // data may already be buffered, e.g. after the handshake
+    return true;
+}
+
+static void ws_poller_remove_at(WsPoller* p, int idx) {
+    memmove(p->entries + idx, p->entries + idx + 1, (p->count - idx - 1) * sizeof(WsPollerEntry));
+    p->count--;
+    if (p->next > idx) p->next--;
+    if (p->next >= p->count) p->next = 0;
+}
+
+void ws_poller_remove(WsPoller* poller, WsConn* conn) {
+    if (!poller) return;
+    int idx = ws_poller_find(poller, conn);
+    if (idx >= 0) ws_poller_remove_at(poller, idx);
+}
+
+bool ws_poller_set_rate(WsPoller* poller, WsConn* conn, size_t bytes_per_sec, size_t burst_bytes) {
+    if (!poller) return false;
+    int idx = ws_poller_find(poller, conn);
+    if (idx < 0) return false;
+    WsPollerEntry* e = &poller->entries[idx];
+    e->rate = bytes_per_sec;
+    e->burst = (double)(burst_bytes ? burst_bytes : bytes_per_sec);
+    e->tokens = e->burst;
+    e->refill_usecs = ws_now_usecs();
+    return true;
+}
+
+// Usecs until the bucket has tokens again, 0 when it has them now. It waits for a few KB of tokens,
+// not to read the socket a few bytes at a time
+static uint64_t ws_poller_throttle(WsPollerEntry* e, uint64_t now) {
+    if (!e->rate) return 0;
+    e->tokens += (double)(now - e->refill_usecs) * (double)e->rate / 1e6;
+    if (e->tokens > e->burst) e->tokens = e->burst;
+    e->refill_usecs = now;
+    double min_tokens = MIN(e->burst, 4096.0);
+    if (e->tokens >= min_tokens) return 0;
+    return (uint64_t)((min_tokens - e->tokens) * 1e6 / (double)e->rate) + 1;
+}
+
+// The reads are capped by the tokens and the bytes left in the tick, the rest waits in the kernel
+static size_t ws_poller_read_limit(const WsPoller* p, const WsPollerEntry* e) {
+    size_t limit = 0;
+    if (e->rate)
+        limit = e->tokens >= 1.0 ? (size_t)e->tokens : 1;
+    if (p->max_bytes && (!limit || p->max_bytes - e->bytes < limit))
+        limit = p->max_bytes - e->bytes;
+    return limit;
+}
+
+static bool ws_poller_has_budget(const WsPoller* p, const WsPollerEntry* e) {
+    if (p->max_frames && e->frames >= p->max_frames) return false;
+    if (p->max_bytes && e->bytes >= p->max_bytes) return false;
+    return true;
+}
+
+// Frames may be waiting in the read buffer or in the socket. A frame consumed without an event,
+// like a pong, leaves readable false, the frames buffered behind it are found by ws_conn_has_frame
+static bool ws_poller_has_data(const WsPollerEntry* e) {
+    return e->readable || ws_conn_has_frame(e->conn) || e->conn->fd < 0;
+}
+
+bool ws_poller_poll_event(WsPoller* poller, WsConn** conn, void** user_data, WsEvent* out_event, int max_usecs) {
+    if (conn) *conn = NULL;
+    if (user_data) *user_data = NULL;
+    if (!poller || !out_event) return false;
+    out_event->type = WS_EVT_NONE;
+    out_event->payload = NULL;
+    out_event->payload_len = 0;
+
+    uint64_t deadline = ws_now_usecs() + (max_usecs > 0 ? (uint64_t)max_usecs : 0);
+    while (true) {
+        uint64_t now = ws_now_usecs();
+        bool budget_exhausted = false;
+
+        // One event per connection and visit, starting after the last one served
+        for (int n = 0; n < poller->count; ++n) {
+            int idx = (poller->next + n) % poller->count;
+            WsPollerEntry* e = &poller->entries[idx];
+            if (!ws_poller_has_data(e) || ws_poller_throttle(e, now))
+                continue;
+            if (!ws_poller_has_budget(poller, e)) {
+                budget_exhausted = true;
+                continue;
+            }
+
+            WsConn* c = e->conn;
+            void* ud = e->user_data;
+            uint64_t read_bytes = c->read_bytes;
+            c->read_limit = ws_poller_read_limit(poller, e);
+            bool got = ws_conn_poll_event(&c, out_event, 0);
+            if (c) {
+                c->read_limit = 0;
+                if (e->rate) e->tokens -= (double)(c->read_bytes - read_bytes);
+            }
+            if (!got) {
+                e->readable = false;
+                continue;
+            }
+
+            if (user_data) *user_data = ud;
+            if (!c) {
+                ws_poller_remove_at(poller, idx);
+                poller->next = poller->count ? idx % poller->count : 0;
+                return true;
+            }
+            e->frames++;
+            e->bytes += out_event->payload_len;
+            poller->next = (idx + 1) % poller->count;
+            if (conn) *conn = c;
+            return true;
+        }
+
+        // New tick. The sockets are checked even when some connections still have frames buffered,
+        // otherwise those would be the only ones served
+        for (int i = 0; i < poller->count; ++i) {
+            poller->entries[i].frames = 0;
+            poller->entries[i].bytes = 0;
+        }
+
+        now = ws_now_usecs();
+        bool expired = !budget_exhausted && max_usecs >= 0 && now >= deadline;
+        uint64_t wait = (budget_exhausted || expired) ? 0 : max_usecs < 0 ? UINT64_MAX : deadline - now;
+
+        // Throttled sockets are left out, their data stays in the kernel until they have tokens
+        int nfds = 0;
+        for (int i = 0; i < poller->count; ++i) {
+            WsPollerEntry* e = &poller->entries[i];
+            uint64_t throttled = ws_poller_throttle(e, now);
+            if (throttled) {
+                if (throttled < wait) wait = throttled;
+                continue;
+            }
+            if (e->conn->fd < 0) {
+                wait = 0;
+                continue;
+            }
+            if (ws_conn_has_frame(e->conn))
+                wait = 0;
+            poller->fds[nfds].fd = e->conn->fd;
+            poller->fds[nfds].events = POLLIN;
+            poller->fds[nfds].revents = 0;
+            poller->fds_entry[nfds++] = i;
+        }
+
+        int rc = ws_poll_usecs(poller->fds, (size_t)nfds, wait == UINT64_MAX ? -1 : (int64_t)MIN(wait, (uint64_t)INT64_MAX));
+        if (rc < 0 && errno != EINTR)
+            return false;
+        if (expired && rc <= 0)
+            return false;
+        for (int i = 0; rc > 0 && i < nfds; ++i)
+            if (poller->fds[i].revents)
+                poller->entries[poller->fds_entry[i]].readable = true;
+    }
+}
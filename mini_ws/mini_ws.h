@@ -6,17 +6,46 @@
 
 // This library implements RFC6455 with these constraints:
 // - No extensions: RSV must be 0
-// - No fragmentation: FIN must be 1, opcode 0 (continuation) is rejected
+// - Fragmented messages are reassembled (up to 64MB, configurable in impl). Outbound messages
+//   can be streamed in fragments with ws_conn_send_begin/chunk/end
 // - Client->server frames must be masked; unmasked frames are protocol error
-// - Payload length is limited to <= 65535 bytes (configurable in impl)
+// - Transports: IPv4, IPv6 and AF_UNIX stream sockets
+// - Received frames are limited to WS_MAX_RECV_MESSAGE (64MB) like the reassembled messages
 // - Control frames must have payload <= 125
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+	struct WsRecorder;
+	struct WsConn;
+	struct WsOutMsg;
+	struct WsServer;
+	struct WsAsset;
+	struct WsDeltaState;
+
+	// Outbound queue classes. Lower values go out first
+	typedef enum {
+		WS_PRIORITY_HIGH = 0,		// small latency critical updates
+		WS_PRIORITY_NORMAL,
+		WS_PRIORITY_LOW,			// large blobs, images
+		WS_PRIORITY_COUNT
+	} WsPriority;
+
+	// Byte stream under a connection. Sockets are the default, see ws_conn_create_transport for others
+	typedef struct WsTransport {
+		// Returns the bytes read, 0 on timeout, < 0 on error or when the peer closed. max_usecs < 0 waits forever
+		int  (*read)(struct WsConn* conn, uint8_t* buf, size_t cap, int max_usecs);
+		// Returns the bytes written, which can be less than len, 0 on timeout, < 0 on error
+		int  (*write)(struct WsConn* conn, const uint8_t* buf, size_t len, int max_usecs);
+		// Releases the transport resources, conn is freed right after
+		void (*close)(struct WsConn* conn);
+	} WsTransport;
+
 	typedef struct WsConn {
-		int  fd;
+		int  fd;							// -1 when the transport is not a socket
+		const WsTransport* transport;
+		void* transport_ctx;				// Owned by the transport
 		bool is_client;
 		bool is_connected;
 
@@ -26,25 +55,145 @@ extern "C" {
 		size_t   read_buffer_capacity;		// Total allocated size of the buffer
 		size_t   read_offset;				// index of next unconsumed byte within that valid region
 		// So available to parse = read_buffer_size - read_offset
+		size_t   read_limit;				// Max bytes per transport read, 0 -> no limit. Set by WsPoller for rate limits
+		uint64_t read_bytes;				// Total bytes read from the transport
 
 		// ... you can add more fields here if needed for your implementation
 		bool close_sent;
 		bool close_received;
 		bool skip_timeout_reading_network;
+		bool handshake_pending;			// Accepted with ws_server_accept_pending, ws_conn_poll_event completes the handshake
+		const struct WsServer* server;		// Not owned. Set while handshake_pending, to answer http requests from its assets
+		bool quickack;						// TCP_QUICKACK is not sticky on linux, re-armed after every recv
+		bool nagle;							// TCP without TCP_NODELAY, messages written in several sends are pushed at their end
+		int  spin_usecs;					// Busy-poll reads this long before waiting in poll, see WsServerConfig
+		struct WsRecorder* recorder;		// Not owned. NULL when not recording
+		uint32_t record_id;					// Connection id in the recording
+
+		// Inbound fragmented message being reassembled
+		uint8_t* fragment_buffer;			// Owned
+		size_t   fragment_size;
+		size_t   fragment_capacity;
+		uint8_t  fragment_opcode;			// 0 when no fragmented message is in progress
+
+		// Outbound streamed message
+		uint8_t  send_stream_opcode;		// 0 when no message is being streamed
+		bool     send_stream_started;		// first fragment already sent
+		uint8_t* send_stream_record;		// Owned. Chunks kept while recording, the log gets whole messages
+		size_t   send_stream_record_size;
+		size_t   send_stream_record_capacity;
+
+		// Outbound queue, see ws_conn_queue_binary
+		struct WsOutMsg* send_queue_head[WS_PRIORITY_COUNT];
+		struct WsOutMsg* send_queue_tail[WS_PRIORITY_COUNT];
+		struct WsOutMsg* send_current;		// Queued message with fragments already sent
+		size_t   send_queued_bytes;			// Payload bytes not sent yet
+		size_t   send_fragment_size;		// Max payload per fragment of queued messages. 0 -> 16KB
+
+		// Delta channel, see ws_conn_send_delta
+		struct WsDeltaState* delta;			// Owned. NULL until the first delta is sent
+		int      delta_keyframe_interval;	// Deltas between keyframes of each key. 0 -> 100
 	} WsConn;
 
+	// Socket tuning applied to the listener and to every accepted connection.
+	// Zero values keep the OS default. Options not supported by the platform are ignored.
+	// Addresses are strings:
+	//   NULL or ""           any IPv4 address (server only)
+	//   "127.0.0.1", "::1"   IPv4 / IPv6 literals or host names. "::" is dual-stack unless ipv6_only is set
+	//   "unix:/tmp/ws.sock"  AF_UNIX stream socket, the port is ignored
+	//   "unix:@name"         AF_UNIX abstract namespace (linux only)
+	typedef struct WsServerConfig {
+		const char* bind_address;			// NULL or "" binds to any IPv4 address
+		bool ipv6_only;						// IPV6_V6ONLY on IPv6 listeners. Dual-stack by default
+		int  backlog;						// listen() backlog, 16 when <= 0
+		bool reuse_addr;					// SO_REUSEADDR on the listener
+		bool tcp_nodelay;					// Disable Nagle, small frames go out immediately
+		bool tcp_quickack;					// Linux only, disable delayed ACKs
+		int  sndbuf_bytes;					// SO_SNDBUF
+		int  rcvbuf_bytes;					// SO_RCVBUF, set on the listener so the window scale is negotiated on accept
+		int  busy_poll_usecs;				// Linux only, SO_BUSY_POLL. May require CAP_NET_ADMIN
+		int  spin_usecs;					// Reads spin on a non-blocking recv this long before sleeping. Burns a core per waiting thread
+		bool keepalive;						// SO_KEEPALIVE to detect dead peers
+		int  keepalive_idle_secs;
+		int  keepalive_interval_secs;
+		int  keepalive_count;
+	} WsServerConfig;
+
+	typedef enum {
+		WS_PROFILE_DEFAULT = 0,			// Same behavior as ws_server_create
+		WS_PROFILE_LOW_LATENCY,				// NODELAY + QUICKACK + busy poll
+		WS_PROFILE_HIGH_THROUGHPUT,			// Large socket buffers, Nagle enabled
+		WS_PROFILE_BUSY_POLL,				// LOW_LATENCY + 200us spin on reads. Pin the polling thread with ws_pin_thread
+	} WsServerProfile;
+
 	typedef struct WsServer {
 		int fd;
+		int family;							// AF_INET, AF_INET6 or AF_UNIX
+		WsServerConfig config;				// bind_address is not kept
+		char* unix_path;					// Owned. Socket file removed on destroy
+		uint64_t unix_file_id;				// Inode of that socket file, destroy leaves a replaced file alone
+		struct WsRecorder* recorder;		// Not owned. Assigned to every accepted connection
+		struct WsAsset* assets;				// Owned. See ws_server_add_asset
 	} WsServer;
 
+	void ws_server_config_init(WsServerConfig* cfg, WsServerProfile profile);
+
+	// Pins the calling thread to a cpu, so a spinning thread is not migrated. Linux and Windows only
+	bool ws_pin_thread(int cpu);
+
 	WsServer* ws_server_create(int port);
+	WsServer* ws_server_create_ex(int port, const WsServerConfig* cfg);
 	WsConn* ws_server_accept(WsServer* server, int max_usecs);	// returns NULL on timeout or error
+	WsConn* ws_server_accept_pending(WsServer* server);			// never waits, returns NULL if no connection is pending. For event loops
 	void ws_server_destroy(WsServer* server);
 
+	// Plain http GET/HEAD requests on the ws port are answered from the registered assets, so one process and
+	// port serve the page and its socket. The data is copied and gzip'ed once here. Responses carry an ETag
+	// (If-None-Match gets a 304) and Cache-Control max-age, or no-cache when max_age_secs is 0.
+	// Unknown paths get a 404. ws_server_accept returns NULL after answering one of these requests
+	bool ws_server_add_asset(WsServer* server, const char* path, const char* content_type,
+		const void* data, size_t len, int max_age_secs);
+
+	// Connects and performs the client handshake. cfg is optional and only the socket options are used
+	WsConn* ws_client_connect(const char* address, int port, const WsServerConfig* cfg, int max_usecs);	// returns NULL on timeout or error
+
 	bool ws_conn_send_binary(WsConn* conn, const void* data, size_t len);
 	bool ws_conn_send_text(WsConn* conn, const char* data, size_t len);
 	void ws_conn_destroy(WsConn* conn);		// best-effort CLOSE; does not wait, conn is not usable after this call
 
+	// Streams one message of unknown size as fragments, without buffering it. Peak memory is the chunk size.
+	// Control frames (pong, close) still go out between chunks. Other data messages fail until ws_conn_send_end
+	// Begin fails while a queued message is half sent, see ws_conn_flush
+	bool ws_conn_send_begin(WsConn* conn, bool is_text);
+	bool ws_conn_send_chunk(WsConn* conn, const void* data, size_t len);
+	bool ws_conn_send_end(WsConn* conn);
+
+	// Queues a copy of the message, it's sent in fragments by ws_conn_flush. Between fragments the pending
+	// control frames go out, and between messages the highest priority queued goes first. RFC6455 doesn't allow
+	// data messages to interleave, so a message already started is finished before any other one.
+	// ws_conn_send_binary/text during a queued message, or while WS_PRIORITY_HIGH messages are waiting, are queued
+	// as WS_PRIORITY_HIGH to keep their order, otherwise they are sent now. Call ws_conn_flush until it returns 1
+	bool ws_conn_queue_binary(WsConn* conn, const void* data, size_t len, WsPriority priority);
+	bool ws_conn_queue_text(WsConn* conn, const char* data, size_t len, WsPriority priority);
+	// Sends queued fragments until the queue is empty or max_usecs elapsed. 0 sends a single fragment
+	// Returns 1 when the queue is empty, 0 when there is more to send, -1 on error
+	int  ws_conn_flush(WsConn* conn, int max_usecs);
+
+	// Delta channel for payloads updated repeatedly, like dashboards or frames. Only the bytes changed since the
+	// previous version sent under the same key on this connection go out. They are sent like ws_conn_send_binary,
+	// which keeps the order when they are diverted to the queue, so that version is the one the peer has. Binary
+	// messages, little endian:
+	//   "MWSD" u8 kind ('K' keyframe, 'D' delta) u32 key u32 seq u32 payload size, then
+	//   K: the payload
+	//   D: until the end, varint unchanged bytes, varint changed bytes, the changed bytes
+	// demo/web_client.html has a decoder. A keyframe is sent the first time, when the size changes, when the
+	// delta would not be smaller, every delta_keyframe_interval deltas or after ws_conn_delta_request_keyframe
+#define WS_DELTA_MAGIC       "MWSD"
+#define WS_DELTA_HEADER_SIZE 17
+
+	bool ws_conn_send_delta(WsConn* conn, uint32_t key, const void* data, size_t len);
+	void ws_conn_delta_request_keyframe(WsConn* conn, uint32_t key);		// e.g. when the peer lost the seq
+
 	typedef enum {
 		WS_EVT_NONE = 0,   // no complete frame available yet
 		WS_EVT_TEXT,       // payload will NOT be null-terminated; payload_len is the length in bytes; payload is not guaranteed to be valid UTF-8
@@ -60,6 +209,62 @@ extern "C" {
 	} WsEvent;
 
 	bool ws_conn_poll_event(WsConn** conn, WsEvent* out_event, int max_usecs);
+	// A complete frame is buffered, the next ws_conn_poll_event gets to it without waiting for the socket
+	bool ws_conn_has_frame(const WsConn* conn);
+
+	// Serves many connections from a single thread. The connections with data are visited round robin, one
+	// event per visit, and each one delivers at most max_frames / max_bytes per tick, so a client flooding the
+	// server doesn't delay the quiet ones. Connections can also be rate limited with a token bucket on the
+	// bytes read, the reads are capped by the tokens left so the excess stays in the socket buffers. Non socket
+	// transports are checked at every tick, poll them with max_usecs 0
+	typedef struct WsPoller WsPoller;
+
+	WsPoller* ws_poller_create(int max_frames_per_tick, size_t max_bytes_per_tick);	// 0 -> unlimited
+	void ws_poller_destroy(WsPoller* poller);		// the connections are not destroyed
+	bool ws_poller_add(WsPoller* poller, WsConn* conn, void* user_data);
+	void ws_poller_remove(WsPoller* poller, WsConn* conn);
+	// bytes_per_sec 0 removes the limit. burst_bytes 0 -> one second of traffic
+	bool ws_poller_set_rate(WsPoller* poller, WsConn* conn, size_t bytes_per_sec, size_t burst_bytes);
+	// Next event of any connection, waiting up to max_usecs (< 0 waits forever). On WS_EVT_CLOSED the connection
+	// was destroyed and removed from the poller, *conn is NULL and *user_data tells which one it was
+	bool ws_poller_poll_event(WsPoller* poller, WsConn** conn, void** user_data, WsEvent* out_event, int max_usecs);
+
+	// Runs the protocol over an already established byte stream. No handshake is performed
+	WsConn* ws_conn_create_transport(const WsTransport* transport, void* ctx, bool is_client);
+
+	// Connected pair over in-memory ring buffers, without kernel calls. Used to benchmark the framing
+	// layer. Writes never block, the rings grow as needed. Both ends must be used from the same thread
+	bool ws_mem_pair_create(WsConn** client, WsConn** server);
+
+	// Session recording to reproduce real traffic, see demo/replay.cpp
+	// The log is append only, written through mmap'd segments where available. Little endian:
+	//   "MWSREC01"
+	//   records:
+	//     u64 usecs since the recorder was created (monotonic)
+	//     u32 connection id, starting at 1
+	//     u32 payload length
+	//     u8  WsRecordKind
+	//     u8  opcode (1 text, 2 binary, 8 close, 9 ping, 10 pong), 0 for open/close records
+	//     payload
+	// Fragmented messages are recorded whole, in both directions, once their last fragment is sent or received.
+	// A zeroed record header marks the end of a log that was not closed properly.
+	// A recorder is not thread safe and must outlive the connections using it.
+	typedef enum {
+		WS_REC_OPEN = 1,
+		WS_REC_IN,							// Message received by this side
+		WS_REC_OUT,							// Message sent by this side
+		WS_REC_CLOSE,
+	} WsRecordKind;
+
+#define WS_RECORD_MAGIC       "MWSREC01"
+#define WS_RECORD_HEADER_SIZE 18
+
+	typedef struct WsRecorder WsRecorder;
+
+	WsRecorder* ws_recorder_create(const char* filename);
+	void ws_recorder_destroy(WsRecorder* recorder);		// flushes and trims the file
+	void ws_conn_set_recorder(WsConn* conn, WsRecorder* recorder);
+	void ws_server_set_recorder(WsServer* server, WsRecorder* recorder);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,432 @@
+#pragma once
+
+// C++20 coroutine layer on top of mini_ws. Header only.
+//
+// A single thread runs a readiness driven Scheduler (poll/WSAPoll). Each connection is
+// handled by its own coroutine with straight-line code, no thread per client:
+//
+//   mini_ws::Task<> session(mini_ws::Conn conn) {
+//       while (true) {
+//           mini_ws::Message msg = co_await conn.recv();
+//           if (msg.closed()) break;
+//           co_await conn.send(msg.payload);
+//       }
+//   }
+//
+//   mini_ws::Task<> acceptLoop(mini_ws::Scheduler& sched, mini_ws::Server& server) {
+//       while (true) {
+//           mini_ws::Conn conn = co_await server.accept();
+//           sched.spawn(session(std::move(conn)));
+//       }
+//   }
+//
+// The sends of the C layer are blocking: send() waits until the socket is writable and then
+// hands the whole frame to the kernel, so very large frames can stall the loop.
+
+#include "mini_ws.h"
+
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <queue>
+#include <span>
+#include <string_view>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <poll.h>
+#endif
+
+namespace mini_ws {
+
+	template< typename T = void >
+	class Task;
+
+	namespace detail {
+
+		struct TaskPromiseBase {
+			std::coroutine_handle<> continuation;
+			std::exception_ptr      error;
+
+			struct FinalAwaiter {
+				bool await_ready() noexcept { return false; }
+				template< typename P >
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+					std::coroutine_handle<> next = h.promise().continuation;
+					return next ? next : std::noop_coroutine();
+				}
+				void await_resume() noexcept {}
+			};
+
+			std::suspend_always initial_suspend() noexcept { return {}; }
+			FinalAwaiter final_suspend() noexcept { return {}; }
+			void unhandled_exception() { error = std::current_exception(); }
+		};
+
+		template< typename T >
+		struct TaskPromise : TaskPromiseBase {
+			std::optional<T> value;
+			Task<T> get_return_object();
+			void return_value(T v) { value.emplace(std::move(v)); }
+		};
+
+		template<>
+		struct TaskPromise<void> : TaskPromiseBase {
+			Task<void> get_return_object();
+			void return_void() {}
+		};
+
+	}
+
+	// Lazy coroutine, starts when awaited or spawned. Move only
+	template< typename T >
+	class [[nodiscard]] Task {
+	public:
+		using promise_type = detail::TaskPromise<T>;
+
+		Task() = default;
+		explicit Task(std::coroutine_handle<promise_type> h) : handle(h) {}
+		Task(Task&& other) noexcept : handle(std::exchange(other.handle, {})) {}
+		Task& operator=(Task&& other) noexcept {
+			if (this != &other) {
+				if (handle) handle.destroy();
+				handle = std::exchange(other.handle, {});
+			}
+			return *this;
+		}
+		Task(const Task&) = delete;
+		Task& operator=(const Task&) = delete;
+		~Task() { if (handle) handle.destroy(); }
+
+		// The awaiter does not own the coroutine, the Task does
+		struct Awaiter {
+			std::coroutine_handle<promise_type> handle;
+
+			bool await_ready() const noexcept { return !handle || handle.done(); }
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+				handle.promise().continuation = caller;
+				return handle;
+			}
+			T await_resume() {
+				promise_type& p = handle.promise();
+				if (p.error)
+					std::rethrow_exception(p.error);
+				if constexpr (!std::is_void_v<T>)
+					return std::move(*p.value);
+			}
+		};
+
+		Awaiter operator co_await() const& noexcept { return Awaiter{ handle }; }
+		Awaiter operator co_await() const&& noexcept { return Awaiter{ handle }; }
+
+	private:
+		std::coroutine_handle<promise_type> handle;
+	};
+
+	namespace detail {
+
+		template< typename T >
+		Task<T> TaskPromise<T>::get_return_object() {
+			return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+		}
+
+		inline Task<void> TaskPromise<void>::get_return_object() {
+			return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+		}
+
+		// Root of a spawned task. Destroys itself when the task finishes
+		struct Detached {
+			struct promise_type {
+				std::unordered_set<void*>* roots = nullptr;
+				~promise_type() {
+					if (roots)
+						roots->erase(std::coroutine_handle<promise_type>::from_promise(*this).address());
+				}
+				Detached get_return_object() { return Detached{ std::coroutine_handle<promise_type>::from_promise(*this) }; }
+				std::suspend_always initial_suspend() noexcept { return {}; }
+				std::suspend_never final_suspend() noexcept { return {}; }
+				void return_void() {}
+				void unhandled_exception() { std::terminate(); }
+			};
+			std::coroutine_handle<promise_type> handle;
+		};
+
+	}
+
+	class Scheduler {
+	public:
+		using Clock = std::chrono::steady_clock;
+
+		Scheduler() = default;
+		Scheduler(const Scheduler&) = delete;
+		Scheduler& operator=(const Scheduler&) = delete;
+
+		// Tasks still suspended are destroyed, which closes their connections
+		~Scheduler() {
+			std::unordered_set<void*> pending = std::move(roots);
+			roots.clear();
+			for (void* root : pending)
+				std::coroutine_handle<>::from_address(root).destroy();
+		}
+
+		// Runs the task detached. Exceptions escaping the task terminate
+		void spawn(Task<void> task) {
+			detail::Detached d = runDetached(std::move(task));
+			d.handle.promise().roots = &roots;
+			roots.insert(d.handle.address());
+			ready.push_back(d.handle);
+		}
+
+		// Returns when all the spawned tasks have finished or stop() is called
+		void run() {
+			stopping = false;
+			while (!roots.empty() && !stopping) {
+				while (!ready.empty() && !stopping) {
+					std::coroutine_handle<> h = ready.front();
+					ready.pop_front();
+					h.resume();
+				}
+				if (roots.empty() || stopping)
+					break;
+
+				Clock::time_point now = Clock::now();
+				while (!timers.empty() && timers.top().at <= now) {
+					ready.push_back(timers.top().handle);
+					timers.pop();
+				}
+				if (!ready.empty())
+					continue;
+
+				// Nothing can wake up the remaining tasks
+				if (waiters.empty() && timers.empty())
+					break;
+
+				int timeout_ms = -1;
+				if (!timers.empty()) {
+					auto wait = std::chrono::ceil<std::chrono::milliseconds>(timers.top().at - now);
+					timeout_ms = (int)wait.count();
+				}
+				pollWaiters(timeout_ms);
+			}
+		}
+
+		void stop() { stopping = true; }
+
+		struct FdAwaiter {
+			Scheduler& sched;
+			int        fd;
+			short      events;
+			bool await_ready() const noexcept { return false; }
+			void await_suspend(std::coroutine_handle<> h) { sched.waiters.push_back({ fd, events, h }); }
+			void await_resume() const noexcept {}
+		};
+
+		struct SleepAwaiter {
+			Scheduler&        sched;
+			Clock::time_point at;
+			bool await_ready() const noexcept { return at <= Clock::now(); }
+			void await_suspend(std::coroutine_handle<> h) { sched.timers.push({ at, sched.timer_seq++, h }); }
+			void await_resume() const noexcept {}
+		};
+
+		FdAwaiter readable(int fd) { return { *this, fd, POLLIN }; }
+		FdAwaiter writable(int fd) { return { *this, fd, POLLOUT }; }
+		SleepAwaiter sleep(std::chrono::microseconds duration) { return { *this, Clock::now() + duration }; }
+
+	private:
+		struct Waiter {
+			int                     fd;
+			short                   events;
+			std::coroutine_handle<> handle;
+		};
+
+		struct Timer {
+			Clock::time_point       at;
+			uint64_t                seq;		// FIFO order for equal deadlines
+			std::coroutine_handle<> handle;
+			bool operator>(const Timer& other) const {
+				return at != other.at ? at > other.at : seq > other.seq;
+			}
+		};
+
+		static detail::Detached runDetached(Task<void> task) {
+			co_await task;
+		}
+
+		void pollWaiters(int timeout_ms) {
+			pfds.clear();
+			for (const Waiter& w : waiters) {
+				pollfd p{};
+				p.fd = w.fd;
+				p.events = w.events;
+				pfds.push_back(p);
+			}
+#ifdef _WIN32
+			if (pfds.empty()) {
+				// WSAPoll fails without sockets, only timers are pending
+				if (timeout_ms > 0)
+					Sleep((DWORD)timeout_ms);
+				return;
+			}
+			int rc = WSAPoll(pfds.data(), (ULONG)pfds.size(), timeout_ms);
+#else
+			int rc = ::poll(pfds.data(), (nfds_t)pfds.size(), timeout_ms);
+#endif
+			if (rc <= 0)
+				return;
+
+			// Errors and hang ups also wake up the waiter, the next io call reports them
+			size_t kept = 0;
+			for (size_t i = 0; i < waiters.size(); ++i) {
+				if (pfds[i].revents)
+					ready.push_back(waiters[i].handle);
+				else
+					waiters[kept++] = waiters[i];
+			}
+			waiters.resize(kept);
+		}
+
+		std::deque<std::coroutine_handle<>> ready;
+		std::vector<Waiter>                 waiters;
+		std::vector<pollfd>                 pfds;
+		std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+		std::unordered_set<void*>           roots;
+		uint64_t                            timer_seq = 0;
+		bool                                stopping = false;
+	};
+
+	struct Message {
+		WsEventType              type = WS_EVT_CLOSED;
+		std::span<const uint8_t> payload;		// Valid until the next recv on the same connection
+
+		bool closed() const { return type == WS_EVT_CLOSED; }
+		std::string_view text() const { return { (const char*)payload.data(), payload.size() }; }
+	};
+
+	// Owns a WsConn. Move only, the connection is closed on destruction
+	class Conn {
+	public:
+		Conn() = default;
+		Conn(Scheduler& sched, WsConn* conn) : sched(&sched), conn(conn) {}
+		Conn(Conn&& other) noexcept : sched(other.sched), conn(std::exchange(other.conn, nullptr)) {}
+		Conn& operator=(Conn&& other) noexcept {
+			if (this != &other) {
+				close();
+				sched = other.sched;
+				conn = std::exchange(other.conn, nullptr);
+			}
+			return *this;
+		}
+		Conn(const Conn&) = delete;
+		Conn& operator=(const Conn&) = delete;
+		~Conn() { close(); }
+
+		void close() {
+			if (conn) {
+				ws_conn_destroy(conn);
+				conn = nullptr;
+			}
+		}
+
+		explicit operator bool() const { return conn != nullptr; }
+		WsConn* get() const { return conn; }
+
+		// Next text or binary message. Pings are answered by the C layer and skipped.
+		// Returns a closed message once the connection is gone
+		Task<Message> recv() {
+			while (conn) {
+				WsEvent evt;
+				if (ws_conn_poll_event(&conn, &evt, 0)) {
+					if (evt.type == WS_EVT_PING)
+						continue;
+					co_return Message{ evt.type, { evt.payload, evt.payload_len } };
+				}
+				// A frame consumed without a message, like a pong, may have more frames buffered behind it
+				if (conn && !ws_conn_has_frame(conn))
+					co_await sched->readable(conn->fd);
+			}
+			co_return Message{};
+		}
+
+		// co_await is kept out of the conditions, gcc 12 miscompiles it there
+		Task<bool> send(std::span<const uint8_t> data) {
+			bool ready = co_await writable();
+			if (!ready)
+				co_return false;
+			co_return ws_conn_send_binary(conn, data.data(), data.size());
+		}
+
+		Task<bool> sendText(std::string_view text) {
+			bool ready = co_await writable();
+			if (!ready)
+				co_return false;
+			if (text.empty())
+				co_return true;
+			co_return ws_conn_send_text(conn, text.data(), text.size());
+		}
+
+	private:
+		// Completes a pending handshake first
+		Task<bool> writable() {
+			while (conn && conn->handshake_pending) {
+				WsEvent evt;
+				if (ws_conn_poll_event(&conn, &evt, 0))
+					co_return false;		// handshake failed, conn is gone
+				if (conn && conn->handshake_pending)
+					co_await sched->readable(conn->fd);
+			}
+			if (!conn)
+				co_return false;
+			co_await sched->writable(conn->fd);
+			co_return conn != nullptr;
+		}
+
+		Scheduler* sched = nullptr;
+		WsConn*    conn = nullptr;
+	};
+
+	// Owns a WsServer. Move only
+	class Server {
+	public:
+		Server(Scheduler& sched, int port) : sched(&sched), server(ws_server_create(port)) {}
+		Server(Scheduler& sched, int port, const WsServerConfig& cfg) : sched(&sched), server(ws_server_create_ex(port, &cfg)) {}
+		Server(Server&& other) noexcept : sched(other.sched), server(std::exchange(other.server, nullptr)) {}
+		Server& operator=(Server&& other) noexcept {
+			if (this != &other) {
+				if (server) ws_server_destroy(server);
+				sched = other.sched;
+				server = std::exchange(other.server, nullptr);
+			}
+			return *this;
+		}
+		Server(const Server&) = delete;
+		Server& operator=(const Server&) = delete;
+		~Server() { if (server) ws_server_destroy(server); }
+
+		explicit operator bool() const { return server != nullptr; }
+		WsServer* get() const { return server; }
+
+		// The websocket handshake is completed by the first recv/send of the connection
+		Task<Conn> accept() {
+			while (server) {
+				if (WsConn* c = ws_server_accept_pending(server))
+					co_return Conn(*sched, c);
+				co_await sched->readable(server->fd);
+			}
+			co_return Conn{};
+		}
+
+	private:
+		Scheduler* sched = nullptr;
+		WsServer*  server = nullptr;
+	};
+
+}